@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "bitmap.h"
+
+#define INT_FROM_ARRAY(ARRAY, INDEX) (*(int *)(&((ARRAY)[(INDEX)])))
+
+void bitmap_convert_palette(PalEntry *pal, const unsigned char *stl) {
+    const unsigned char *src = &(stl[STL_PALETTE_OFFSET]);
+    unsigned char *dst = (unsigned char *)pal;
+    unsigned int i = 0;
+
+#ifdef __SSSE3__
+    /* 4 byte entries in, 3 byte entries out, 4 at a time */
+    const __m128i swizzle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1);
+    __m128i v;
+
+    /* each store runs 4 bytes over in to the next group, so stop before the
+       last one. */
+    for(; i < 256 - 4; i += 4) {
+        v = _mm_loadu_si128((const __m128i *)&(src[i * 4]));
+        _mm_storeu_si128((__m128i *)&(dst[i * 3]), _mm_shuffle_epi8(v, swizzle));
+    }
+#endif
+
+    for(; i < 256; i++) {
+        dst[i * 3] = src[i * 4 + 2];
+        dst[i * 3 + 1] = src[i * 4 + 1];
+        dst[i * 3 + 2] = src[i * 4];
+    }
+}
+
+void bitmap_convert_header(TGAHeader *tga, const unsigned char *stl) {
+    tga->IDLength = 0;
+    tga->colorMapType = 1;
+    tga->dataTypeCode = TGA_TYPE_INDEXED;
+    tga->colorMapStart = 0;
+    tga->colorMapLength = 256;
+    tga->colorMapDepth = 24;
+    tga->originX = 0;
+    tga->originY = 0;
+    tga->width = INT_FROM_ARRAY(stl, STL_WIDTH_OFFSET);
+    tga->height = INT_FROM_ARRAY(stl, STL_HEIGHT_OFFSET);
+    tga->width = (tga->width / 4 + ((tga->width % 4) ? 1 : 0)) * 4;
+    tga->bitsPerPixel = 8;
+    tga->descriptor = 0;
+
+    bitmap_convert_palette(tga->pal, stl);
+}
+
+/* dataSize is the amount of pixel data in the chunks following the header */
+int bitmap_init(Bitmap *b, const TGAHeader *tga, const unsigned char *stl,
+                unsigned int dataSize) {
+    int width, height;
+
+    /* rows are found by dividing by the width, so it can't be 0 */
+    width = INT_FROM_ARRAY(stl, STL_WIDTH_OFFSET);
+    height = INT_FROM_ARRAY(stl, STL_HEIGHT_OFFSET);
+    if(width <= 0 || height <= 0 ||
+       width > BITMAP_MAX_DIMENSION || height > BITMAP_MAX_DIMENSION) {
+        fprintf(stderr, "Bitmap is %dx%d, which isn't a size it can be.\n",
+                        width, height);
+        return(-1);
+    }
+
+    b->stride = (unsigned short int)tga->width;
+    b->height = (unsigned short int)tga->height;
+
+    /* rows are usually already padded, but pad them if they aren't */
+    b->srcStride = b->stride;
+    if((unsigned int)width != b->stride &&
+       dataSize == (unsigned int)width * b->height) {
+        b->srcStride = width;
+    }
+
+    b->pixels = calloc(b->height, b->stride);
+    if(b->pixels == NULL) {
+        fprintf(stderr, "Failed to allocate memory for bitmap.\n");
+        return(-1);
+    }
+    b->out = NULL;
+    b->outSize = 0;
+
+    return(0);
+}
+
+/* pos is the offset of data in the STL image data */
+void bitmap_set_data(Bitmap *b, unsigned int pos,
+                     const unsigned char *data, unsigned int size) {
+    unsigned int row, col;
+    unsigned int count;
+
+    while(size > 0) {
+        row = pos / b->srcStride;
+        col = pos % b->srcStride;
+        if(row >= b->height) {
+            break;
+        }
+
+        count = b->srcStride - col;
+        if(count > size) {
+            count = size;
+        }
+        if(col < b->stride) {
+            memcpy(&(b->pixels[row * b->stride + col]), data,
+                   (col + count > b->stride) ? b->stride - col : count);
+        }
+
+        data += count;
+        pos += count;
+        size -= count;
+    }
+}
+
+/* how many bytes are the same as the first, up to max */
+unsigned int rle_run_length(const unsigned char *p, unsigned int max) {
+    unsigned int i = 0;
+
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi8(p[0]);
+    unsigned int mask;
+
+    for(; i + 16 <= max; i += 16) {
+        mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&(p[i])), v));
+        if(mask != 0xFFFF) {
+            return(i + __builtin_ctz(~mask));
+        }
+    }
+#endif
+
+    for(; i < max; i++) {
+        if(p[i] != p[0]) {
+            break;
+        }
+    }
+
+    return(i);
+}
+
+/* how many bytes until a run worth encoding starts, up to max */
+unsigned int rle_raw_length(const unsigned char *p, unsigned int max) {
+    unsigned int i = 0;
+
+#ifdef __SSE2__
+    __m128i a, b, c;
+    unsigned int mask;
+
+    for(; i + 18 <= max; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)&(p[i]));
+        b = _mm_loadu_si128((const __m128i *)&(p[i + 1]));
+        c = _mm_loadu_si128((const __m128i *)&(p[i + 2]));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b),
+                                               _mm_cmpeq_epi8(b, c)));
+        if(mask != 0) {
+            return(i + __builtin_ctz(mask));
+        }
+    }
+#endif
+
+    for(; i + 2 < max; i++) {
+        if(p[i] == p[i + 1] && p[i + 1] == p[i + 2]) {
+            return(i);
+        }
+    }
+
+    return(max);
+}
+
+unsigned int rle_encode_row(unsigned char *out, const unsigned char *row,
+                            unsigned int width) {
+    unsigned int x = 0;
+    unsigned int max;
+    unsigned int count;
+    unsigned char *o = out;
+
+    while(x < width) {
+        max = width - x;
+        if(max > TGA_RLE_MAX_PACKET) {
+            max = TGA_RLE_MAX_PACKET;
+        }
+
+        count = rle_run_length(&(row[x]), max);
+        if(count >= 2) {
+            *(o++) = 0x80 | (count - 1);
+            *(o++) = row[x];
+        } else {
+            count = rle_raw_length(&(row[x]), max);
+            *(o++) = count - 1;
+            memcpy(o, &(row[x]), count);
+            o += count;
+        }
+        x += count;
+    }
+
+    return(o - out);
+}
+
+int bitmap_encode(Bitmap *b, TGAHeader *tga, int rle) {
+    unsigned int y;
+
+    if(!rle) {
+        b->out = b->pixels;
+        b->outSize = b->stride * b->height;
+        tga->dataTypeCode = TGA_TYPE_INDEXED;
+        return(0);
+    }
+
+    /* worst case is a raw packet header for every 128 pixels.  packets never
+       cross rows, as the format recommends. */
+    b->out = malloc(b->height *
+                    (b->stride + (b->stride + TGA_RLE_MAX_PACKET - 1) / TGA_RLE_MAX_PACKET));
+    if(b->out == NULL) {
+        fprintf(stderr, "Failed to allocate memory for RLE data.\n");
+        return(-1);
+    }
+
+    b->outSize = 0;
+    for(y = 0; y < b->height; y++) {
+        b->outSize += rle_encode_row(&(b->out[b->outSize]),
+                                     &(b->pixels[y * b->stride]), b->stride);
+    }
+    tga->dataTypeCode = TGA_TYPE_INDEXED_RLE;
+
+    return(0);
+}
+
+void bitmap_free(Bitmap *b) {
+    if(b->out != NULL && b->out != b->pixels) {
+        free(b->out);
+    }
+    free(b->pixels);
+    b->out = NULL;
+    b->pixels = NULL;
+}
@@ -0,0 +1,58 @@
+#define TGA_TYPE_INDEXED     (1)
+#define TGA_TYPE_INDEXED_RLE (9)
+
+#define TGA_RLE_MAX_PACKET   (128)
+
+#define STL_WIDTH_OFFSET     (4)
+#define STL_HEIGHT_OFFSET    (8)
+#define STL_PALETTE_OFFSET   (40)
+/* up to the end of the palette, everything the header is converted from */
+#define STL_HEADER_SIZE      (STL_PALETTE_OFFSET + 256 * 4)
+
+/* widest or tallest a bitmap can be and still fit in a TGA header once its
+   rows are padded to a multiple of 4 */
+#define BITMAP_MAX_DIMENSION (32764)
+
+typedef struct __attribute__((packed)) {
+    char b, g, r;
+} PalEntry;
+
+typedef struct __attribute__((packed)) {
+    char IDLength;
+    char colorMapType;
+    char dataTypeCode;
+    short int colorMapStart;
+    short int colorMapLength;
+    char colorMapDepth;
+    short int originX;
+    short int originY;
+    short int width;
+    short int height;
+    char bitsPerPixel;
+    char descriptor;
+
+    PalEntry pal[256];
+} TGAHeader;
+
+typedef struct {
+    /* rows as stored in the STL chunks */
+    unsigned int srcStride;
+    unsigned int height;
+
+    /* TGA rows, always padded to a multiple of 4 */
+    unsigned int stride;
+    unsigned char *pixels;
+
+    /* image data as it goes in the file */
+    unsigned char *out;
+    unsigned int outSize;
+} Bitmap;
+
+void bitmap_convert_header(TGAHeader *tga, const unsigned char *stl);
+void bitmap_convert_palette(PalEntry *pal, const unsigned char *stl);
+int bitmap_init(Bitmap *b, const TGAHeader *tga, const unsigned char *stl,
+                unsigned int dataSize);
+void bitmap_set_data(Bitmap *b, unsigned int pos,
+                     const unsigned char *data, unsigned int size);
+int bitmap_encode(Bitmap *b, TGAHeader *tga, int rle);
+void bitmap_free(Bitmap *b);
@@ -0,0 +1,732 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "riff.h"
+#include "hash.h"
+#include "output.h"
+#include "bitmap.h"
+#include "flc.h"
+#include "pipeline.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "song.h"
+#include "trace.h"
+#include "check.h"
+
+/* Go through the whole structure of an SI and report everything wrong with
+   it, rather than giving up at the first thing like riff_open does.  The top
+   of the file is checked first, then each song is checked on its own on
+   whichever thread gets to it, with its problems kept apart from the others
+   until they're all sorted and printed at the end.
+
+   An entry which can't be found ends the scan of the node it's in, since
+   there's no telling where the next one is, but the node's size still says
+   where the next entry after it is. */
+
+typedef struct {
+    RIFFFile *r;
+    int fd;
+
+    /* songs, and what was found in each */
+    int *job;
+    CheckReport *report;
+    unsigned int jobs;
+
+    pthread_mutex_t lock;
+    unsigned int next;
+    int failed;
+} CheckJobs;
+
+typedef struct {
+    Track *t;
+    CheckTrack *track;
+    CheckReport *rep;
+} CheckSong;
+
+void report_init(CheckReport *rep) {
+    rep->problem = NULL;
+    rep->problems = 0;
+    rep->problemMem = 0;
+    rep->entries = 0;
+}
+
+int check_problem(CheckReport *rep, off_t offset, const char *format, ...)
+                  __attribute__((format(printf, 3, 4)));
+
+int check_problem(CheckReport *rep, off_t offset, const char *format, ...) {
+    CheckProblem *p;
+    unsigned int count;
+    va_list ap;
+
+    if(rep->problems == rep->problemMem) {
+        count = rep->problemMem == 0 ? CHECK_INITIAL_PROBLEMS : rep->problemMem * 2;
+        p = realloc(rep->problem, sizeof(CheckProblem) * count);
+        if(p == NULL) {
+            fprintf(stderr, "Failed to allocate memory for problem.\n");
+            return(-1);
+        }
+        rep->problem = p;
+        rep->problemMem = count;
+    }
+
+    p = &(rep->problem[rep->problems]);
+    p->offset = offset;
+    va_start(ap, format);
+    vsnprintf(p->message, sizeof(p->message), format, ap);
+    va_end(ap);
+    rep->problems++;
+
+    return(0);
+}
+
+#define KEY_CHARS(KEY) FOURCC_CHAR((KEY), 0), FOURCC_CHAR((KEY), 1), \
+                       FOURCC_CHAR((KEY), 2), FOURCC_CHAR((KEY), 3)
+
+/* add the immediate children of a node like riff_scan, but note anything
+   wrong and go on.  returns -1 only if it couldn't go on at all. */
+int check_scan(RIFFFile *r, RIFFReader *rd, int index, CheckReport *rep) {
+    RIFFHeader h;
+    off_t offset;
+    unsigned int size;
+    off_t pos = 0;
+    off_t last;
+    int cur;
+
+    if(!RIFF_TYPE(r, index)->isNode) {
+        return(0);
+    }
+
+    offset = riff_entry_offset(r, index);
+    riff_reader_seek(rd, offset, SEEK_SET);
+
+    size = r->size[index];
+    while(pos + CHUNK_MINIMUM_SIZE < size) {
+        /* where the entry should have been, not where the scan for it gave
+           up */
+        last = pos;
+        if(riff_next_entry(rd, offset, size, &pos, &h) < 0) {
+            if(check_problem(rep, offset + last,
+                             "no entry found, last %lld bytes of %c%c%c%c skipped",
+                             (long long)(size - last),
+                             KEY_CHARS(RIFF_TYPE(r, index)->key)) < 0) {
+                return(-1);
+            }
+            break;
+        }
+        rep->entries++;
+
+        /* keep it inside its parent so what's in it can still be checked */
+        if((off_t)h.start + h.size > size) {
+            if(check_problem(rep, offset + h.start,
+                             "%c%c%c%c runs %lld bytes past the end of its parent",
+                             KEY_CHARS(isLIST(h.fourCC) ? h.fourCC2 : h.fourCC),
+                             (long long)h.start + h.size - size) < 0) {
+                return(-1);
+            }
+            h.size = size - h.start;
+        }
+
+        cur = riff_add_child(r, index, h.start);
+        if(cur == -1) {
+            return(-1);
+        }
+        if(riff_set_type(r, cur, h.fourCC, h.fourCC2) < 0) {
+            riff_drop_child(r, index);
+            return(-1);
+        }
+        r->size[cur] = h.size;
+
+        if(!h.forged) {
+            riff_reader_seek(rd, h.size, SEEK_CUR);
+            pos += h.size;
+        }
+    }
+
+    return(0);
+}
+
+int check_populate(RIFFFile *r, RIFFReader *rd, int index, CheckReport *rep) {
+    int entries;
+    int i;
+
+    if(check_scan(r, rd, index, rep) < 0) {
+        return(-1);
+    }
+
+    /* children may add more nodes, so look these up each time */
+    entries = riff_entries(r, index);
+    for(i = 0; i < entries; i++) {
+        if(check_populate(r, rd, r->entry[r->node[index]] + i, rep) < 0) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+/* every chunk needs an MxOb to go with it, and all partial chunks of a track
+   have to be finished by a chunk after them before the track ends, with as
+   much in them as the first one says. */
+int check_chunk_cb(RIFFFile *r, int dir, int ent, void *priv) {
+    CheckSong *s = priv;
+    int index = RIFF_ENTRY(r, dir, ent);
+    unsigned char hdr[OMNI_CHUNK_HEADER_SIZE];
+    off_t offset;
+    short int chunkType;
+    unsigned int trackNum;
+    unsigned int length;
+    unsigned int body;
+    CheckTrack *track;
+    MxOb *o;
+
+    offset = riff_entry_offset(r, index);
+    if(r->size[index] < sizeof(hdr)) {
+        return(check_problem(s->rep, offset, "MxCh is only %u bytes",
+                             r->size[index]));
+    }
+    if(pread_all(s->t->fd, hdr, sizeof(hdr), offset) < 0) {
+        return(check_problem(s->rep, offset, "MxCh header couldn't be read"));
+    }
+    chunkType = SHORT_FROM_ARRAY(hdr, 0);
+    trackNum = INT_FROM_ARRAY(hdr, 2);
+    length = INT_FROM_ARRAY(hdr, 10);
+    body = r->size[index] - sizeof(hdr);
+
+    o = get_trackNum(s->t, trackNum);
+    if(o == NULL) {
+        return(check_problem(s->rep, offset, "MxCh for track %u has no MxOb",
+                             trackNum));
+    }
+    track = &(s->track[o - s->t->mxob]);
+
+    if(track->ended) {
+        if(check_problem(s->rep, offset, "MxCh for %s comes after its end",
+                         o->trackName) < 0) {
+            return(-1);
+        }
+    }
+    if(chunkType == OMNI_CHUNK_TYPE_LAST) {
+        if(track->partial >= 0) {
+            if(check_problem(s->rep, track->partial,
+                             "partial MxCh for %s ended by the end of the track",
+                             o->trackName) < 0) {
+                return(-1);
+            }
+        }
+        track->ended = 1;
+        track->partial = -1;
+        return(0);
+    }
+
+    /* the first of a run of partial chunks gives the size of the whole run,
+       up to and including the chunk which finishes it */
+    if(track->partial < 0 && chunkType == OMNI_CHUNK_TYPE_PARTIAL) {
+        track->partial = offset;
+        track->partialSize = length;
+        track->partialBody = 0;
+    }
+    if(track->partial < 0) {
+        if(length > body &&
+           check_problem(s->rep, offset, "MxCh has a %u byte body but room for %u",
+                         length, body) < 0) {
+            return(-1);
+        }
+        return(0);
+    }
+
+    track->partialBody += body;
+    if(chunkType != OMNI_CHUNK_TYPE_PARTIAL) {
+        if(track->partialBody != track->partialSize &&
+           check_problem(s->rep, track->partial,
+                         "partial MxCh for %s says %u bytes but its run has %u",
+                         o->trackName, track->partialSize,
+                         track->partialBody) < 0) {
+            return(-1);
+        }
+        track->partial = -1;
+    }
+
+    return(0);
+}
+
+int check_chunks(RIFFFile *r, Track *t, CheckReport *rep) {
+    CheckSong s;
+    unsigned int i, j;
+    int ret = -1;
+
+    s.t = t;
+    s.rep = rep;
+    s.track = malloc(sizeof(CheckTrack) * t->mxobs);
+    if(s.track == NULL) {
+        fprintf(stderr, "Failed to allocate memory for tracks.\n");
+        return(-1);
+    }
+    for(i = 0; i < t->mxobs; i++) {
+        s.track[i].partial = -1;
+        s.track[i].ended = 0;
+    }
+
+    /* chunks would go to the first one */
+    for(i = 0; i < t->mxobs; i++) {
+        for(j = 0; j < i; j++) {
+            if(t->mxob[i].trackNum == t->mxob[j].trackNum &&
+               check_problem(rep, riff_entry_offset(r, 0),
+                             "%s and %s are both track %u", t->mxob[j].trackName,
+                             t->mxob[i].trackName, t->mxob[i].trackNum) < 0) {
+                goto error0;
+            }
+        }
+    }
+
+    if(do_traverse(r, MxDaMxChPattern, check_chunk_cb, &s, 0, 0) < 0) {
+        goto error0;
+    }
+
+    for(i = 0; i < t->mxobs; i++) {
+        if(s.track[i].partial >= 0 &&
+           check_problem(rep, s.track[i].partial,
+                         "partial MxCh for %s is never finished",
+                         t->mxob[i].trackName) < 0) {
+            goto error0;
+        }
+    }
+    ret = 0;
+
+error0:
+    free(s.track);
+    return(ret);
+}
+
+/* the song is indexed on its own, the same as a subtree is when indexing in
+   parallel, and then its MxObs and chunks are gone through. */
+int check_song(RIFFFile *r, RIFFReader *rd, int song, CheckReport *rep) {
+    unsigned long long start = trace_now();
+    RIFFFile *sub;
+    const RIFFType *type;
+    Track t;
+    int ret = -1;
+
+    sub = riff_init();
+    if(sub == NULL) {
+        return(-1);
+    }
+    sub->f = r->f;
+    type = RIFF_TYPE(r, song);
+    if(riff_grow(sub, -1, riff_entry_offset(r, song)) < 0 ||
+       riff_set_type(sub, 0, type->fourCC, type->fourCC2) < 0) {
+        goto error0;
+    }
+    sub->size[0] = r->size[song];
+
+    if(check_populate(sub, rd, 0, rep) < 0) {
+        goto error0;
+    }
+
+    t.index = 0;
+    t.fd = fileno(r->f);
+    song_init(&t);
+    if(song_read_mxobs(sub, &t) < 0) {
+        if(check_problem(rep, riff_entry_offset(sub, 0),
+                         "MxObs of the song couldn't be read") < 0) {
+            goto error1;
+        }
+    } else if(check_chunks(sub, &t, rep) < 0) {
+        goto error1;
+    }
+    ret = 0;
+
+    trace_span(start, "check_song", "%s at %lld",
+               t.mxobs > 0 ? t.mxob[0].trackName : "",
+               (long long)riff_entry_offset(sub, 0));
+error1:
+    song_free(&t);
+error0:
+    riff_free(sub);
+    return(ret);
+}
+
+void *check_worker(void *priv) {
+    CheckJobs *p = priv;
+    RIFFReader *rd;
+    unsigned int j;
+
+    rd = malloc(sizeof(RIFFReader));
+    if(rd == NULL) {
+        fprintf(stderr, "Failed to allocate memory for reader.\n");
+        goto error0;
+    }
+    riff_reader_init(rd, p->fd);
+    trace_thread("check");
+
+    for(;;) {
+        pthread_mutex_lock(&(p->lock));
+        j = p->next;
+        p->next++;
+        pthread_mutex_unlock(&(p->lock));
+        if(j >= p->jobs) {
+            break;
+        }
+
+        if(check_song(p->r, rd, p->job[j], &(p->report[j])) < 0) {
+            goto error1;
+        }
+    }
+
+    free(rd);
+    trace_thread_done();
+    return(NULL);
+
+error1:
+    free(rd);
+    trace_thread_done();
+error0:
+    pthread_mutex_lock(&(p->lock));
+    p->failed = 1;
+    /* stop the others picking up anything more */
+    p->next = p->jobs;
+    pthread_mutex_unlock(&(p->lock));
+    return(NULL);
+}
+
+int check_songs(CheckJobs *p, int threads) {
+    pthread_t *thread;
+    int j;
+    int ret = -1;
+
+    thread = malloc(sizeof(pthread_t) * threads);
+    if(thread == NULL) {
+        fprintf(stderr, "Failed to allocate memory for threads.\n");
+        return(-1);
+    }
+    if(pthread_mutex_init(&(p->lock), NULL) != 0) {
+        fprintf(stderr, "Failed to create mutex.\n");
+        goto error0;
+    }
+    p->next = 0;
+    p->failed = 0;
+
+    for(j = 0; j < threads; j++) {
+        errno = pthread_create(&(thread[j]), NULL, check_worker, p);
+        if(errno != 0) {
+            fprintf(stderr, "Failed to create thread: %s\n", strerror(errno));
+            break;
+        }
+    }
+    if(j == 0) {
+        goto error1;
+    }
+    for(j--; j >= 0; j--) {
+        pthread_join(thread[j], NULL);
+    }
+    if(!p->failed) {
+        ret = 0;
+    }
+
+error1:
+    pthread_mutex_destroy(&(p->lock));
+error0:
+    free(thread);
+    return(ret);
+}
+
+int offset_compare(const void *a, const void *b) {
+    const off_t *o1 = a;
+    const off_t *o2 = b;
+
+    if(*o1 < *o2) {
+        return(-1);
+    } else if(*o1 > *o2) {
+        return(1);
+    }
+    return(0);
+}
+
+/* every offset in MxOf has to be the header of a song */
+int check_mxof(RIFFFile *r, int mxof, CheckJobs *p, CheckReport *rep) {
+    unsigned int *offsets;
+    off_t *songs;
+    unsigned int size;
+    unsigned int count;
+    off_t offset;
+    off_t header;
+    unsigned int i;
+    int ret = -1;
+
+    offset = riff_entry_offset(r, mxof);
+    size = r->size[mxof] & ~3;
+    if(size < 4) {
+        return(check_problem(rep, offset, "MxOf is only %u bytes", r->size[mxof]));
+    }
+
+    offsets = malloc(size);
+    songs = malloc(sizeof(off_t) * (p->jobs + 1));
+    if(offsets == NULL || songs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for MxOf.\n");
+        goto error0;
+    }
+    if(pread_all(p->fd, (unsigned char *)offsets, size, offset) < 0) {
+        ret = check_problem(rep, offset, "MxOf couldn't be read");
+        goto error0;
+    }
+
+    /* songs are found in order, so these are sorted already */
+    for(i = 0; i < p->jobs; i++) {
+        songs[i] = riff_entry_offset(r, p->job[i]) - 8;
+    }
+
+    count = offsets[0];
+    if(count > size / 4 - 1) {
+        if(check_problem(rep, offset, "MxOf has %u offsets but room for %u",
+                         count, size / 4 - 1) < 0) {
+            goto error0;
+        }
+        count = size / 4 - 1;
+    }
+    for(i = 1; i <= count; i++) {
+        header = offsets[i];
+        if(header != 0 &&
+           bsearch(&header, songs, p->jobs, sizeof(off_t), offset_compare) == NULL &&
+           check_problem(rep, offset + i * 4, "MxOf offset %u is %u, not a song",
+                         i - 1, offsets[i]) < 0) {
+            goto error0;
+        }
+    }
+    ret = 0;
+
+error0:
+    free(songs);
+    free(offsets);
+    return(ret);
+}
+
+int problem_compare(const void *a, const void *b) {
+    const CheckProblem *p1 = a;
+    const CheckProblem *p2 = b;
+
+    if(p1->offset < p2->offset) {
+        return(-1);
+    } else if(p1->offset > p2->offset) {
+        return(1);
+    }
+    return(strcmp(p1->message, p2->message));
+}
+
+/* print every problem in the order they're in the file, and how much of the
+   file is sound */
+int check_print(const char *filename, RIFFFile *r, CheckReport *top,
+                CheckJobs *p) {
+    CheckProblem *all;
+    unsigned int problems = top->problems;
+    unsigned int entries = top->entries;
+    unsigned int sound = 0;
+    long long bytes = 0;
+    long long soundBytes = 0;
+    unsigned int i;
+
+    for(i = 0; i < p->jobs; i++) {
+        problems += p->report[i].problems;
+        entries += p->report[i].entries;
+        bytes += r->size[p->job[i]] + 8;
+        if(p->report[i].problems == 0) {
+            sound++;
+            soundBytes += r->size[p->job[i]] + 8;
+        }
+    }
+
+    all = malloc(sizeof(CheckProblem) * (problems + 1));
+    if(all == NULL) {
+        fprintf(stderr, "Failed to allocate memory for problems.\n");
+        return(-1);
+    }
+    if(top->problems > 0) {
+        memcpy(all, top->problem, sizeof(CheckProblem) * top->problems);
+    }
+    problems = top->problems;
+    for(i = 0; i < p->jobs; i++) {
+        if(p->report[i].problems > 0) {
+            memcpy(&(all[problems]), p->report[i].problem,
+                   sizeof(CheckProblem) * p->report[i].problems);
+            problems += p->report[i].problems;
+        }
+    }
+    qsort(all, problems, sizeof(CheckProblem), problem_compare);
+
+    for(i = 0; i < problems; i++) {
+        printf("%s: %lld: %s\n", filename, (long long)all[i].offset,
+               all[i].message);
+    }
+    printf("%s: %u entries, %u of %u songs sound (%lld of %lld bytes), "
+           "%u problem%s.\n", filename, entries, sound, p->jobs,
+           soundBytes, bytes, problems, problems == 1 ? "" : "s");
+    free(all);
+
+    return(problems);
+}
+
+/* check one SI with threads checking songs, returns 1 if anything is wrong
+   with it */
+int check(const char *filename, int threads) {
+    unsigned long long start = trace_now();
+    RIFFFile *r;
+    FILE *f;
+    RIFFReader *rd = NULL;
+    CheckReport top;
+    CheckJobs p;
+    struct stat st;
+    unsigned int hdr[3];
+    unsigned int size;
+    int entries, ent, list;
+    int songs, song;
+    int *job;
+    int index;
+    int mxof = -1;
+    unsigned int i;
+    int ret = -1;
+
+    f = fopen(filename, "rb");
+    if(f == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
+        return(-1);
+    }
+    r = riff_init();
+    if(r == NULL) {
+        fclose(f);
+        return(-1);
+    }
+    r->f = f;
+    report_init(&top);
+    p.r = r;
+    p.fd = fileno(f);
+    p.jobs = 0;
+    p.job = NULL;
+    p.report = NULL;
+
+    if(fstat(p.fd, &st) < 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", filename, strerror(errno));
+        goto error0;
+    }
+    if(st.st_size < (off_t)sizeof(hdr) ||
+       pread_all(p.fd, (unsigned char *)hdr, sizeof(hdr), 0) < 0 ||
+       !isRIFF(hdr[0]) || hdr[1] < 4) {
+        if(check_problem(&top, 0, "not a RIFF file") < 0) {
+            goto error0;
+        }
+        goto print;
+    }
+    /* only what's really there is checked */
+    size = hdr[1] - 4;
+    if((off_t)hdr[1] + 8 != st.st_size) {
+        if(check_problem(&top, 12, "RIFF is %u bytes but the file has %lld",
+                         hdr[1] + 8, (long long)st.st_size) < 0) {
+            goto error0;
+        }
+        if((off_t)size > st.st_size - 12) {
+            size = st.st_size - 12;
+        }
+    }
+
+    if(riff_grow(r, -1, 12) < 0 || riff_set_type(r, 0, hdr[0], hdr[2]) < 0) {
+        goto error0;
+    }
+    r->size[0] = size;
+
+    rd = malloc(sizeof(RIFFReader));
+    if(rd == NULL) {
+        fprintf(stderr, "Failed to allocate memory for reader.\n");
+        goto error0;
+    }
+    riff_reader_init(rd, p.fd);
+
+    /* the top two levels are checked here, to find the songs */
+    if(check_scan(r, rd, 0, &top) < 0) {
+        goto error0;
+    }
+    entries = riff_entries(r, 0);
+    for(ent = 0; ent < entries; ent++) {
+        index = RIFF_ENTRY(r, 0, ent);
+
+        if(RIFF_TYPE(r, index)->fourCC == MxHd_FOURCC && r->size[index] < 12) {
+            if(check_problem(&top, riff_entry_offset(r, index),
+                             "MxHd is only %u bytes", r->size[index]) < 0) {
+                goto error0;
+            }
+        } else if(RIFF_TYPE(r, index)->fourCC == MxOf_FOURCC && mxof < 0) {
+            mxof = index;
+        }
+
+        if(!RIFF_TYPE(r, index)->isLIST ||
+           RIFF_TYPE(r, index)->key != MxSt_FOURCC) {
+            if(check_populate(r, rd, index, &top) < 0) {
+                goto error0;
+            }
+            continue;
+        }
+
+        if(check_scan(r, rd, index, &top) < 0) {
+            goto error0;
+        }
+        list = index;
+        songs = riff_entries(r, list);
+        job = realloc(p.job, sizeof(int) * (p.jobs + songs + 1));
+        if(job == NULL) {
+            fprintf(stderr, "Failed to allocate memory for songs.\n");
+            goto error0;
+        }
+        p.job = job;
+        for(song = 0; song < songs; song++) {
+            index = RIFF_ENTRY(r, list, song);
+            if(RIFF_TYPE(r, index)->fourCC == MxSt_FOURCC) {
+                p.job[p.jobs] = index;
+                p.jobs++;
+            } else if(RIFF_TYPE(r, index)->fourCC != pad_FOURCC) {
+                if(check_problem(&top, riff_entry_offset(r, index),
+                                 "%c%c%c%c in the list of songs",
+                                 KEY_CHARS(RIFF_TYPE(r, index)->key)) < 0) {
+                    goto error0;
+                }
+            }
+        }
+    }
+
+    p.report = malloc(sizeof(CheckReport) * (p.jobs + 1));
+    if(p.report == NULL) {
+        fprintf(stderr, "Failed to allocate memory for reports.\n");
+        goto error0;
+    }
+    for(i = 0; i < p.jobs; i++) {
+        report_init(&(p.report[i]));
+    }
+    if(p.jobs > 0 && check_songs(&p, threads) < 0) {
+        goto error1;
+    }
+    if(mxof >= 0 && check_mxof(r, mxof, &p, &top) < 0) {
+        goto error1;
+    }
+
+print:
+    ret = check_print(filename, r, &top, &p);
+    if(ret > 0) {
+        ret = 1;
+    }
+    trace_span(start, "check", "%s", filename);
+
+error1:
+    if(p.report != NULL) {
+        for(i = 0; i < p.jobs; i++) {
+            free(p.report[i].problem);
+        }
+        free(p.report);
+    }
+error0:
+    free(p.job);
+    free(rd);
+    free(top.problem);
+    riff_close(r);
+    return(ret);
+}
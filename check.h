@@ -0,0 +1,32 @@
+#define CHECK_MESSAGE_MAX (128)
+#define CHECK_INITIAL_PROBLEMS (16)
+
+/* something wrong with an SI, at the offset of the entry's data as list
+   shows it */
+typedef struct {
+    off_t offset;
+    char message[CHECK_MESSAGE_MAX];
+} CheckProblem;
+
+/* what was found in one part of an SI, each thread keeps its own */
+typedef struct {
+    CheckProblem *problem;
+    unsigned int problems;
+    unsigned int problemMem;
+
+    unsigned int entries;
+} CheckReport;
+
+/* state of a track while its chunks are gone through */
+typedef struct {
+    /* of the first chunk of a run of partial chunks which hasn't been
+       finished, otherwise -1 */
+    off_t partial;
+    /* size the first one says the run is, and what's in it so far */
+    unsigned int partialSize;
+    unsigned int partialBody;
+    /* its last chunk was seen */
+    int ended;
+} CheckTrack;
+
+int check(const char *filename, int threads);
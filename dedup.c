@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "output.h"
+#include "dedup.h"
+
+/* Contents are told apart by their hash and size, so an asset is only linked
+   to one that's really the same, and the first copy is what it's linked to.
+   A later asset with the same name as the first copy replaces it, so then the
+   first copy is forgotten. */
+
+Dedup *dedup_init() {
+    Dedup *d;
+
+    d = malloc(sizeof(Dedup));
+    if(d == NULL) {
+        fprintf(stderr, "Failed to allocate memory for dedup table.\n");
+        return(NULL);
+    }
+    d->entry = NULL;
+    d->entries = 0;
+    d->entryMem = 0;
+    d->slots = DEDUP_INITIAL_SLOTS;
+    d->slot = calloc(d->slots, sizeof(unsigned int));
+    d->nameSlot = calloc(d->slots, sizeof(unsigned int));
+    d->linked = 0;
+    d->saved = 0;
+    if(d->slot == NULL || d->nameSlot == NULL) {
+        fprintf(stderr, "Failed to allocate memory for dedup table.\n");
+        dedup_free(d);
+        return(NULL);
+    }
+
+    return(d);
+}
+
+/* where an entry with these contents is, or the empty slot it would go in */
+unsigned int *find_contents(Dedup *d, unsigned long long hash,
+                            unsigned int size) {
+    unsigned int i = hash & (d->slots - 1);
+    DedupEntry *e;
+
+    for(;; i = (i + 1) & (d->slots - 1)) {
+        if(d->slot[i] == 0) {
+            return(&(d->slot[i]));
+        }
+        e = &(d->entry[d->slot[i] - 1]);
+        if(!e->dead && e->hash == hash && e->size == size) {
+            return(&(d->slot[i]));
+        }
+    }
+}
+
+unsigned int *find_name(Dedup *d, const char *name) {
+    unsigned int i = hash_string(name) & (d->slots - 1);
+
+    for(;; i = (i + 1) & (d->slots - 1)) {
+        if(d->nameSlot[i] == 0 ||
+           strcmp(d->entry[d->nameSlot[i] - 1].name, name) == 0) {
+            return(&(d->nameSlot[i]));
+        }
+    }
+}
+
+/* tables are kept at most half full */
+int dedup_grow(Dedup *d) {
+    unsigned int *slot, *nameSlot;
+    unsigned int i;
+    DedupEntry *e;
+
+    slot = calloc(d->slots * 2, sizeof(unsigned int));
+    nameSlot = calloc(d->slots * 2, sizeof(unsigned int));
+    if(slot == NULL || nameSlot == NULL) {
+        fprintf(stderr, "Failed to allocate memory to grow dedup table.\n");
+        free(slot);
+        free(nameSlot);
+        return(-1);
+    }
+    free(d->slot);
+    free(d->nameSlot);
+    d->slot = slot;
+    d->nameSlot = nameSlot;
+    d->slots *= 2;
+
+    for(i = 0; i < d->entries; i++) {
+        e = &(d->entry[i]);
+        if(!e->dead) {
+            *find_contents(d, e->hash, e->size) = i + 1;
+        }
+        *find_name(d, e->name) = i + 1;
+    }
+
+    return(0);
+}
+
+/* add an entry for name, whatever had that name before is gone now.  returns
+   the new entry's index + 1. */
+unsigned int add_entry(Dedup *d, unsigned long long hash, unsigned int size,
+                       const char *name, unsigned int target) {
+    unsigned int *nameSlot;
+    DedupEntry *e;
+
+    if(strlen(name) >= sizeof(e->name)) {
+        fprintf(stderr, "Name too long to deduplicate: %s\n", name);
+        return(0);
+    }
+
+    if((d->entries + 1) * 2 > d->slots) {
+        if(dedup_grow(d) < 0) {
+            return(0);
+        }
+    }
+    if(d->entries == d->entryMem) {
+        e = realloc(d->entry, sizeof(DedupEntry) * (d->entryMem + d->slots));
+        if(e == NULL) {
+            fprintf(stderr, "Failed to allocate memory to grow dedup table.\n");
+            return(0);
+        }
+        d->entry = e;
+        d->entryMem += d->slots;
+    }
+
+    nameSlot = find_name(d, name);
+    if(*nameSlot != 0) {
+        d->entry[*nameSlot - 1].dead = 1;
+    }
+
+    e = &(d->entry[d->entries]);
+    e->hash = hash;
+    e->size = size;
+    strncpy(e->name, name, sizeof(e->name));
+    e->target = target;
+    e->dead = 0;
+    d->entries++;
+
+    /* links aren't looked up by contents, only what they're linked to is */
+    if(target == 0) {
+        *find_contents(d, hash, size) = d->entries;
+    }
+    *nameSlot = d->entries;
+
+    return(d->entries);
+}
+
+/* returns 1 and the name of the first copy if these contents were seen
+   before, otherwise 0 and name becomes the first copy.  first is name itself
+   when name is the first copy, and 2 is returned when name was already a link
+   to it. */
+int dedup_check(Dedup *d, unsigned long long hash, unsigned int size,
+                const char *name, const char **first) {
+    unsigned int found;
+    unsigned int index;
+    DedupEntry *e;
+
+    found = *find_contents(d, hash, size);
+    if(found == 0) {
+        if(add_entry(d, hash, size, name, 0) == 0) {
+            return(-1);
+        }
+        *first = NULL;
+        return(0);
+    }
+
+    index = *find_name(d, name);
+    if(index != 0) {
+        e = &(d->entry[index - 1]);
+        if(!e->dead && index == found) {
+            *first = e->name;
+            return(1);
+        } else if(!e->dead && e->target == found) {
+            *first = d->entry[found - 1].name;
+            return(2);
+        }
+    }
+
+    if(add_entry(d, hash, size, name, found) == 0) {
+        return(-1);
+    }
+    *first = d->entry[found - 1].name;
+
+    return(1);
+}
+
+void dedup_free(Dedup *d) {
+    free(d->entry);
+    free(d->slot);
+    free(d->nameSlot);
+    free(d);
+}
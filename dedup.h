@@ -0,0 +1,34 @@
+#define DEDUP_INITIAL_SLOTS (1024)
+
+/* the first asset written with some contents */
+typedef struct {
+    unsigned long long hash;
+    unsigned int size;
+    char name[OUTPUT_NAME_MAX];
+
+    /* entry index + 1 of the first copy when this is a link to it */
+    unsigned int target;
+
+    /* something else was written with the same name since */
+    int dead;
+} DedupEntry;
+
+typedef struct {
+    DedupEntry *entry;
+    unsigned int entries;
+    unsigned int entryMem;
+
+    /* open addressed tables of entry indexes + 1, by contents and by name */
+    unsigned int *slot;
+    unsigned int *nameSlot;
+    unsigned int slots;
+
+    /* links made this run and how much they saved */
+    unsigned int linked;
+    unsigned long long saved;
+} Dedup;
+
+Dedup *dedup_init();
+int dedup_check(Dedup *d, unsigned long long hash, unsigned int size,
+                const char *name, const char **first);
+void dedup_free(Dedup *d);
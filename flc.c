@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flc.h"
+
+int flc_is_header(const unsigned char *data, unsigned int size) {
+    if(size < FLIC_HEADER_SIZE) {
+        return(0);
+    }
+
+    if(((const FLICHeader *)data)->magic != FLIC_MAGIC) {
+        return(0);
+    }
+
+    return(1);
+}
+
+void flc_index_init(FLICIndex *idx) {
+    idx->frame = NULL;
+    idx->frames = 0;
+}
+
+/* continued data belongs to the last frame, as frames may be split across
+   partial chunks */
+int flc_index_add(FLICIndex *idx, unsigned int offset, unsigned int size,
+                  int continued) {
+    FLICFrame *f;
+
+    if(continued && idx->frames > 0) {
+        idx->frame[idx->frames - 1].size += size;
+        return(0);
+    }
+
+    f = realloc(idx->frame, sizeof(FLICFrame) * (idx->frames + 1));
+    if(f == NULL) {
+        fprintf(stderr, "Failed to allocate memory to grow frame index.\n");
+        return(-1);
+    }
+
+    idx->frame = f;
+    idx->frame[idx->frames].offset = offset;
+    idx->frame[idx->frames].size = size;
+    idx->frames++;
+
+    return(0);
+}
+
+void flc_fix_header(FLICHeader *h, const FLICIndex *idx, unsigned int size) {
+    h->size = size;
+    h->frames = idx->frames > 0xFFFF ? 0xFFFF : idx->frames;
+
+    if(idx->frames > 0) {
+        h->oFrame1 = idx->frame[0].offset;
+    }
+    if(idx->frames > 1) {
+        h->oFrame2 = idx->frame[1].offset;
+    }
+}
+
+void flc_index_free(FLICIndex *idx) {
+    free(idx->frame);
+    flc_index_init(idx);
+}
@@ -0,0 +1,49 @@
+#define FLIC_MAGIC          (0xAF12)
+#define FLIC_HEADER_SIZE    (128)
+
+typedef struct __attribute__((packed)) {
+    unsigned int size;
+    unsigned short int magic;
+    unsigned short int frames;
+    unsigned short int width;
+    unsigned short int height;
+    unsigned short int depth;
+    unsigned short int flags;
+    unsigned int speed;
+    unsigned short int reserved1;
+    unsigned int created;
+    unsigned int creator;
+    unsigned int updated;
+    unsigned int updater;
+    unsigned short int aspectX;
+    unsigned short int aspectY;
+    unsigned short int extFlags;
+    unsigned short int keyFrames;
+    unsigned short int totalFrames;
+    unsigned int reqMemory;
+    unsigned short int maxRegions;
+    unsigned short int transpNum;
+    unsigned char reserved2[24];
+    unsigned int oFrame1;
+    unsigned int oFrame2;
+    unsigned char reserved3[40];
+} FLICHeader;
+
+/* written out as is for the sidecar index, so a frame can be found by seeking
+   to its number * sizeof(FLICFrame) */
+typedef struct {
+    unsigned int offset;
+    unsigned int size;
+} FLICFrame;
+
+typedef struct {
+    FLICFrame *frame;
+    unsigned int frames;
+} FLICIndex;
+
+int flc_is_header(const unsigned char *data, unsigned int size);
+void flc_index_init(FLICIndex *idx);
+int flc_index_add(FLICIndex *idx, unsigned int offset, unsigned int size,
+                  int continued);
+void flc_fix_header(FLICHeader *h, const FLICIndex *idx, unsigned int size);
+void flc_index_free(FLICIndex *idx);
@@ -0,0 +1,132 @@
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME64_1 (0x9E3779B185EBCA87ULL)
+#define PRIME64_2 (0xC2B2AE3D27D4EB4FULL)
+#define PRIME64_3 (0x165667B19E3779F9ULL)
+#define PRIME64_4 (0x85EBCA77C2B2AE63ULL)
+#define PRIME64_5 (0x27D4EB2F165667C5ULL)
+
+#define ROTL64(X, R) (((X) << (R)) | ((X) >> (64 - (R))))
+
+unsigned long long read64(const unsigned char *p) {
+    unsigned long long v;
+
+    memcpy(&v, p, sizeof(v));
+    return(v);
+}
+
+unsigned int read32(const unsigned char *p) {
+    unsigned int v;
+
+    memcpy(&v, p, sizeof(v));
+    return(v);
+}
+
+unsigned long long hash_round(unsigned long long acc, unsigned long long in) {
+    acc += in * PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return(acc * PRIME64_1);
+}
+
+unsigned long long hash_merge(unsigned long long acc, unsigned long long v) {
+    acc ^= hash_round(0, v);
+    return(acc * PRIME64_1 + PRIME64_4);
+}
+
+void hash_init(Hash *h) {
+    h->v[0] = PRIME64_1 + PRIME64_2;
+    h->v[1] = PRIME64_2;
+    h->v[2] = 0;
+    h->v[3] = -PRIME64_1;
+    h->total = 0;
+    h->bufLen = 0;
+}
+
+void hash_stripe(Hash *h, const unsigned char *p) {
+    h->v[0] = hash_round(h->v[0], read64(p));
+    h->v[1] = hash_round(h->v[1], read64(p + 8));
+    h->v[2] = hash_round(h->v[2], read64(p + 16));
+    h->v[3] = hash_round(h->v[3], read64(p + 24));
+}
+
+void hash_update(Hash *h, const void *data, unsigned int size) {
+    const unsigned char *p = data;
+    unsigned int count;
+
+    h->total += size;
+
+    /* finish off a stripe left over from last time */
+    if(h->bufLen > 0) {
+        count = sizeof(h->buf) - h->bufLen;
+        if(count > size) {
+            count = size;
+        }
+        memcpy(&(h->buf[h->bufLen]), p, count);
+        h->bufLen += count;
+        p += count;
+        size -= count;
+        if(h->bufLen < sizeof(h->buf)) {
+            return;
+        }
+        hash_stripe(h, h->buf);
+        h->bufLen = 0;
+    }
+
+    for(; size >= sizeof(h->buf); size -= sizeof(h->buf), p += sizeof(h->buf)) {
+        hash_stripe(h, p);
+    }
+
+    memcpy(h->buf, p, size);
+    h->bufLen = size;
+}
+
+unsigned long long hash_final(const Hash *h) {
+    unsigned long long acc;
+    const unsigned char *p = h->buf;
+    unsigned int size = h->bufLen;
+
+    if(h->total >= sizeof(h->buf)) {
+        acc = ROTL64(h->v[0], 1) + ROTL64(h->v[1], 7) +
+              ROTL64(h->v[2], 12) + ROTL64(h->v[3], 18);
+        acc = hash_merge(acc, h->v[0]);
+        acc = hash_merge(acc, h->v[1]);
+        acc = hash_merge(acc, h->v[2]);
+        acc = hash_merge(acc, h->v[3]);
+    } else {
+        acc = PRIME64_5;
+    }
+    acc += h->total;
+
+    for(; size >= 8; size -= 8, p += 8) {
+        acc ^= hash_round(0, read64(p));
+        acc = ROTL64(acc, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if(size >= 4) {
+        acc ^= (unsigned long long)read32(p) * PRIME64_1;
+        acc = ROTL64(acc, 23) * PRIME64_2 + PRIME64_3;
+        size -= 4;
+        p += 4;
+    }
+    for(; size > 0; size--, p++) {
+        acc ^= *p * PRIME64_5;
+        acc = ROTL64(acc, 11) * PRIME64_1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= PRIME64_2;
+    acc ^= acc >> 29;
+    acc *= PRIME64_3;
+    acc ^= acc >> 32;
+
+    return(acc);
+}
+
+unsigned long long hash_string(const char *s) {
+    Hash h;
+
+    hash_init(&h);
+    hash_update(&h, s, strlen(s));
+    return(hash_final(&h));
+}
@@ -0,0 +1,12 @@
+/* XXH64 of whatever is given to hash_update, in as many pieces as needed */
+typedef struct {
+    unsigned long long v[4];
+    unsigned long long total;
+    unsigned char buf[32];
+    unsigned int bufLen;
+} Hash;
+
+void hash_init(Hash *h);
+void hash_update(Hash *h, const void *data, unsigned int size);
+unsigned long long hash_final(const Hash *h);
+unsigned long long hash_string(const char *s);
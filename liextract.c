@@ -2,568 +2,498 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
 
 #include "riff.h"
+#include "stream.h"
+#include "hash.h"
+#include "output.h"
+#include "bitmap.h"
+#include "flc.h"
+#include "pipeline.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "song.h"
+#include "listing.h"
+#include "serve.h"
+#include "subset.h"
+#include "trace.h"
+#include "check.h"
 
-#define SHORT_FROM_ARRAY(ARRAY, INDEX) (*(short int *)(&((ARRAY)[(INDEX)])))
-#define INT_FROM_ARRAY(ARRAY, INDEX) (*(int *)(&((ARRAY)[(INDEX)])))
-
-#define OMNI_TRACK_TYPE_WAVE    (4)
-#define OMNI_TRACK_TYPE_RAW     (3)
-#define OMNI_TRACK_TYPE_BITMAP  (10)
-
-#define OMNI_CHUNK_HEADER_SIZE (14)
-#define OMNI_CHUNK_FLC_HEADER_SIZE (20)
-
-#define OMNI_CHUNK_TYPE_DATA (0)
-#define OMNI_CHUNK_TYPE_PARTIAL (16)
-#define OMNI_CHUNK_TYPE_LAST (2)
-
-const char WAVType[] = {'W', 'A', 'V', 'E'};
-const char fmtHdr[] = {'f', 'm', 't', ' '};
-const char dataHdr[] = {'d', 'a', 't', 'a'};
-
-typedef struct __attribute__((packed)) {
-    char RIFF[4];
-    int fileSize;
-    char WAVE[4];
-    char fmt[4];
-    int fmtSize;
-    short int format;
-    short int channels;
-    int sampleRate;
-    int bytesPerSecond;
-    short int bytesPerSample;
-    short int bitsPerSample;
-    char data[4];
-    int dataSize;
-} WAVHeader;
-
-#define WAV_FILE_SIZE_OFFSET (4)
-#define WAV_DATA_SIZE_OFFSET (40)
-#define WAV_FILE_SIZE_ADD    (sizeof(WAVHeader) - 8)
-
-typedef struct __attribute__((packed)) {
-    char b, g, r;
-} PalEntry;
-
-typedef struct __attribute__((packed)) {
-    char IDLength;
-    char colorMapType;
-    char dataTypeCode;
-    short int colorMapStart;
-    short int colorMapLength;
-    char colorMapDepth;
-    short int originX;
-    short int originY;
-    short int width;
-    short int height;
-    char bitsPerPixel;
-    char descriptor;
-
-    PalEntry pal[256];
-} TGAHeader;
-
-typedef struct {
-    unsigned int size;
-    unsigned char data[65536];
-
-    /* required fields */
-    short int chunkType;
-    int trackNum;
-    int timestamp;
-    int hdrSize;
-} Chunk;
-
-const char FLCfmt[] = {' ', 'F', 'L', 'C'};
-
-typedef struct {
-    FILE *out;
-
-    /* for WAV tracks */
-    WAVHeader wav;
-
-    /* for STL bitmap objects */
-    TGAHeader tga;
-
-    char trackName[64];
-    short int trackType;
-    unsigned int trackNum;
-
-    /* for muxed types, these values are not in the main MxOb */
-    char fileName[256];
-    char format[4];
-} MxOb;
-
-typedef struct {
-    int index;
-
-    MxOb *mxob;
-    unsigned int mxobs;
-
-    /* fields from first audio chunk */
-    /* WAV fmt header */
-
-    Chunk *c;
-    unsigned int chunks;
-} Track;
-
-MxOb *mxob_grow(Track *t) {
-    MxOb *m2;
-
-    m2 = realloc(t->mxob, sizeof(MxOb) * (t->mxobs + 1));
-    if(m2 == NULL) {
-        fprintf(stderr, "Failed to allocate memory to grow MxOb table.\n");
-        return(NULL);
-    }
-
-    t->mxob = m2;
-    t->mxobs++;
-
-    return(&(t->mxob[t->mxobs-1]));
-}
+int dump_song_cb(RIFFFile *r, int dir, int ent, void *priv) {
+    Track *t = priv;
+    unsigned long long start = trace_now();
+    /* the song is gone by the time its span ends */
+    char name[TRACE_ARG_MAX] = "";
+    int ret;
 
-int populate_mxob(Track *t, unsigned char *buf, unsigned int length) {
-    MxOb *o;
-    unsigned int dataPos = 0;
-    unsigned int nameLength;
+    t->index = RIFF_ENTRY(r, dir, ent);
 
-    o = mxob_grow(t);
-    if(o == NULL) {
-        return(-1);
-    }
-    o->out = NULL;
+    song_init(t);
 
-    o->trackType = SHORT_FROM_ARRAY(buf, dataPos);
-     /* flag as uninitialized */
-    if(o->trackType == OMNI_TRACK_TYPE_WAVE) {
-        o->wav.fileSize = 0;
-    } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP) {
-        o->tga.dataTypeCode = 0;
+    if(song_read_mxobs(r, t) < 0) {
+        goto error0;
+    }
+    if(start != 0) {
+        snprintf(name, sizeof(name), "%s", t->mxob[0].trackName);
     }
 
-    /* If there's a string directly after the value, discard it. */
-    for(dataPos = 2; dataPos < length; dataPos++) {
-        if(buf[dataPos] == 0) {
-            break;
-        }
+    if(!t->verify) {
+        print_mxobs(t);
     }
-    /* find the start of the name */
-    for(; dataPos < length; dataPos++) {
-        if(buf[dataPos] != 0) {
-            break;
+
+    /* everything from the last run is still there */
+    if(t->manifest != NULL) {
+        ret = song_unchanged(t);
+        if(ret != 0) {
+            if(ret > 0) {
+                printf("Unchanged since the last run.\n\n");
+            }
+            song_free(t);
+            trace_span(start, "song", "%s, unchanged", name);
+            return(ret < 0 ? -1 : 0);
         }
     }
 
-    nameLength = strlen((char *)&(buf[dataPos]));
-    if(nameLength >= sizeof(o->trackName)) {
-        fprintf(stderr, "Track name too long.\n");
-        return(-1);
+    if(song_read_chunks(r, t) < 0) {
+        goto error0;
     }
-    strncpy(o->trackName, (char *)&(buf[dataPos]), sizeof(o->trackName));
-    dataPos += nameLength + 1;
-
-    o->trackNum = INT_FROM_ARRAY(buf, dataPos);
 
-    if(!isMuxed(o->trackType)) {
-        dataPos += 92;
-        nameLength = *(unsigned short int *)&(buf[dataPos]);
-        dataPos += 2;
-        if(nameLength > 0) {
-            dataPos += nameLength;
-        }
-        nameLength = strlen((char *)&(buf[dataPos]));
-        if(nameLength >= sizeof(o->fileName)) {
-            fprintf(stderr, "Track file name too long.\n");
-            return(-1);
-        }
-        strncpy(o->fileName, (char *)&(buf[dataPos]), sizeof(o->fileName));
-        dataPos += nameLength + 1 + 12;
-        memcpy(o->format, &(buf[dataPos]), sizeof(o->format));
-    }
-        
+    ret = write_song(t);
+    trace_span(start, "song", "%s", name);
+    return(ret);
 
-    return(0);
+error0:
+    song_free(t);
+    trace_span(start, "song", "%s, failed", name);
+    return(-1);
 }
 
-int get_track_info_cb(RIFFFile *r, int dir, int ent, void *priv) {
-    int index = RIFF_ENTRY(r, dir, ent);
+/* Streaming extraction picks out the same entries as dump_song_cb as they go
+   by, and writes each song out once the end of it is reached. */
+int stream_entry_cb(const RIFFStreamEntry *e, void *priv) {
     Track *t = priv;
-    unsigned int MxObLength;
-    unsigned char MxObData[65536];
-
-    if(r->root[index].size > sizeof(MxObData)) {
-        fprintf(stderr, "MxOb too big.\n");
-        return(-1);
-    }
 
-    if(riff_entry_seekto(r, index) < 0) {
-        fprintf(stderr, "Failed to seek to MxOb.\n");
-        return(-1);
+    if(riff_stream_match(e, 0, SongPattern)) {
+        song_init(t);
+        t->index = e->depth;
+        return(0);
     }
 
-    MxObLength = r->root[index].size;
-    if(fread(MxObData, 1, MxObLength, r->f) < MxObLength) {
-        fprintf(stderr, "Failed to read MxOb.\n");
-        return(-1);
+    /* not in a song */
+    if(t->index < 0 || e->isNode) {
+        return(0);
     }
 
-    if(populate_mxob(t, MxObData, MxObLength) < 0) {
-        return(-1);
+    if(riff_stream_match(e, t->index, MxObPattern) ||
+       riff_stream_match(e, t->index, MxChMxObPattern) ||
+       riff_stream_match(e, t->index, MxChMxChMxObPattern) ||
+       riff_stream_match(e, t->index, MxChMxChMxChMxObPattern)) {
+        if(e->size > MXOB_MAX_SIZE) {
+            fprintf(stderr, "MxOb too big.\n");
+            return(-1);
+        }
+        return(populate_mxob(t, e->data, e->size));
+    } else if(riff_stream_match(e, t->index, MxDaMxChPattern)) {
+        return(add_chunk(t, e->data, e->size));
     }
 
     return(0);
 }
 
-Chunk *track_grow(Track *t) {
-    Chunk *c2;
+int stream_leave_cb(const RIFFStreamEntry *e, void *priv) {
+    Track *t = priv;
 
-    c2 = realloc(t->c, sizeof(Chunk) * (t->chunks + 1));
-    if(c2 == NULL) {
-        fprintf(stderr, "Failed to allocate memory to grow entry table.\n");
-        return(NULL);
+    if(t->index < 0 || !riff_stream_match(e, 0, SongPattern)) {
+        return(0);
     }
+    t->index = -1;
 
-    t->c = c2;
-    t->chunks++;
-
-    return(&(t->c[t->chunks-1]));
-}
-
-MxOb *get_trackNum(Track *t, unsigned int trackNum) {
-    unsigned int i;
+    if(t->mxob == NULL) {
+        fprintf(stderr, "Failed to find MxOb.\n");
+        song_free(t);
+        return(-1);
+    }
 
-    for(i = 0; i < t->mxobs; i++) {
-        if(t->mxob[i].trackNum == trackNum) {
-            return(&(t->mxob[i]));
-        }
+    if(!t->verify) {
+        print_mxobs(t);
     }
 
-    return(NULL);
+    return(write_song(t));
 }
 
-int read_chunks_cb(RIFFFile *r, int dir, int ent, void *priv) {
-    Track *t = priv;
-    Chunk *c;
-    MxOb *o;
-    int index = RIFF_ENTRY(r, dir, ent);
-    unsigned char *body;
-    unsigned int i;
-
-    if(r->root[index].size > sizeof(c->data)) {
-        fprintf(stderr, "Chunk data too large.\n");
-        return(-1);
-    }
+/* list in to l or extract one SI, - reads a stream from stdin, front to back
+   without an index.  returns 1 if it couldn't all be read. */
+int process_file(Track *t, Listing *l, const char *filename, int extract,
+                 int threads) {
+    RIFFFile *r;
+    unsigned int fallbacks = 0;
+    unsigned long long start;
+    int ret = 0;
 
-    if(riff_entry_seekto(r, index) < 0) {
-        fprintf(stderr, "Failed to seek to MxCh.\n");
+    if(!extract && listing_file(l, filename) < 0) {
         return(-1);
     }
 
-    c = track_grow(t);
-    if(c == NULL) {
-        return(-1);
+    if(strcmp(filename, "-") == 0) {
+        start = trace_now();
+        t->fd = -1;
+        t->fingerprint = 0;
+        t->index = -1;
+        /* MxObs are only needed for the fields they add to the listing */
+        if(riff_stream(STDIN_FILENO, extract || l->format != LISTING_TEXT,
+                       extract ? stream_entry_cb : listing_stream_cb,
+                       extract ? stream_leave_cb : NULL,
+                       extract ? (void *)t : (void *)l, &fallbacks) < 0) {
+            fprintf(stderr, "Failed to read stream.\n");
+            ret = 1;
+        }
+        trace_span(start, "riff_stream", "stdin, %u scanned for", fallbacks);
+        fprintf(stderr, "%u entries had to be scanned for.\n", fallbacks);
+        return(ret);
     }
 
-    c->size = r->root[index].size;
-    if(fread(c->data, 1, c->size, r->f) < c->size) {
-        fprintf(stderr, "Failed to read MxCh.\n");
+    r = riff_open(filename, threads);
+    if(r == NULL) {
+        fprintf(stderr, "Failed to open.\n");
         return(-1);
     }
-
-    c->chunkType = SHORT_FROM_ARRAY(c->data, 0);
-    c->trackNum = INT_FROM_ARRAY(c->data, 2);
-    c->timestamp = INT_FROM_ARRAY(c->data, 6);
-    c->hdrSize = INT_FROM_ARRAY(c->data, 10);
-
-    o = get_trackNum(t, c->trackNum);
-    if(o == NULL) {
-        fprintf(stderr, "Couldn't find object associated with track %u.\n", c->trackNum);
-        return(-1);
+    fprintf(stderr, "Indexed %u entries, %u had to be scanned for.\n",
+                    r->entryCount, r->fallbacks);
+    t->fd = fileno(r->f);
+    if(t->manifest != NULL) {
+        t->fingerprint = manifest_fingerprint(t->fd, t->rle, t->frameIndex);
     }
-     /* this pointer may become invalid later, but it will be assigned again */
-    body = &(c->data[OMNI_CHUNK_HEADER_SIZE]);
-    if(o->trackType == OMNI_TRACK_TYPE_WAVE && o->wav.fileSize == 0) {
-        /* set up initial fields in track */
-        memcpy(o->wav.RIFF, RIFFMagic, sizeof(o->wav.RIFF));
-        memcpy(o->wav.WAVE, WAVType, sizeof(o->wav.WAVE));
-        memcpy(o->wav.fmt, fmtHdr, sizeof(o->wav.fmt));
-        o->wav.fmtSize = 16;
-        memcpy(o->wav.data, dataHdr, sizeof(o->wav.data));
-        o->wav.dataSize = -1;
-        o->wav.fileSize = -1;
-
-        /* fill out what we know */
-        o->wav.format = SHORT_FROM_ARRAY(body, 0);
-        o->wav.channels = SHORT_FROM_ARRAY(body, 2);
-        o->wav.sampleRate = INT_FROM_ARRAY(body, 4);
-        o->wav.bytesPerSecond = INT_FROM_ARRAY(body, 8);
-        o->wav.bytesPerSample = SHORT_FROM_ARRAY(body, 12);
-        o->wav.bitsPerSample = SHORT_FROM_ARRAY(body, 14);
-    } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP && o->tga.dataTypeCode == 0) {
-        /* convert the existing header to Targa. */
-        o->tga.IDLength = 0;
-        o->tga.colorMapType = 1;
-        o->tga.dataTypeCode = 1; /* indexed */
-        o->tga.colorMapStart = 0;
-        o->tga.colorMapLength = 256;
-        o->tga.colorMapDepth = 24;
-        o->tga.originX = 0;
-        o->tga.originY = 0;
-        o->tga.width = INT_FROM_ARRAY(body, 4);
-        o->tga.height = INT_FROM_ARRAY(body, 8);
-        o->tga.width = (o->tga.width / 4 + ((o->tga.width % 4) ? 1 : 0)) * 4;
-        o->tga.bitsPerPixel = 8;
-        o->tga.descriptor = 0;
-
-        for(i = 0; i < 256; i++) {
-            o->tga.pal[i].r = body[40 + (i * 4)];
-            o->tga.pal[i].g = body[40 + (i * 4) + 1];
-            o->tga.pal[i].b = body[40 + (i * 4) + 2];
+
+    if(extract == 0) {
+        if(listing_index(l, r) < 0) {
+            fprintf(stderr, "Failed to traverse file.\n");
+            ret = 1;
+        }
+    } else {
+        if(riff_traverse(r, "MxStMxSt", dump_song_cb, t) < 0) {
+            fprintf(stderr, "Failed to traverse file.\n");
+            ret = 1;
         }
     }
 
-    return(0);
-}
+    riff_close(r);
 
-void print_mxob(MxOb *o) {
-    printf("Name: %s\n"
-           "Type: %d\n"
-           "Track num: %d\n",
-           o->trackName,
-           o->trackType,
-           o->trackNum);
+    return(ret);
 }
 
-int dump_song_cb(RIFFFile *r, int dir, int ent, void *priv) {
-    Track *t = priv;
-    t->index = RIFF_ENTRY(r, dir, ent);
-    unsigned int i;
-    unsigned char *body;
-    unsigned int toWrite;
-    MxOb *o;
+void usage(const char *argv0) {
+    fprintf(stderr, "USAGE: %s list [-j <threads>] [-F text|json|csv|bin] <filename|->...\n"
+                    "  -F  --format, json is an object per line, bin is described in listing.h\n"
+                    "       %s extract [-d] [-f] [-j <threads>] [-r] [-u] [-w <writers>]\n"
+                    "                  [-m <manifest> | -t <archive.tar|->] <filename|->...\n"
+                    "  -d  write files with O_DIRECT, skipping the page cache\n"
+                    "  -f  write a frame offset index next to each FLC\n"
+                    "  -j  threads to use for building the index\n"
+                    "  -m  keep outputs which are unchanged since the run which wrote the manifest\n"
+                    "  -r  write bitmaps as RLE compressed TGA\n"
+                    "  -t  write all assets to a single tar archive, - for stdout\n"
+                    "  -u  link copies of an asset to the first one written\n"
+                    "  -w  threads to use for writing assets, 1 for archive streams\n"
+                    "       %s verify [-j <threads>] [-r] [-w <writers>] <filename|->...\n"
+                    "  assemble every track without writing it, and print its digest, size\n"
+                    "  and chunk count\n"
+                    "       %s serve [-j <threads>] [-w <writers>] <socket> <filename>...\n"
+                    "       %s subset [-j <threads>] <filename> <output> <song>...\n"
+                    "  write a new SI with only the songs named\n"
+                    "       %s check [-j <threads>] <filename>...\n"
+                    "  report everything wrong with the structure of each SI, with the offset\n"
+                    "  of the entry it's in, and how much of it is sound\n"
+                    "  --trace <out.json> may be given to any command but serve, to record\n"
+                    "  where the time went in Chrome trace-event format\n"
+                    "A filename of - reads the SI from stdin in a single pass.\n",
+                    argv0, argv0, argv0, argv0, argv0, argv0);
+}
 
-    t->mxobs = 0;
-    t->mxob = NULL;
+int main(int argc, char **argv) {
+    int extract;
+    int server = 0;
+    int subsetting = 0;
+    int checking = 0;
+    int verify = 0;
+    int failed = 0;
+    struct timespec start, end;
+    double seconds;
+    int dedup = 0;
+    Track t;
+    const char *tarName = NULL;
+    const char *manifestName = NULL;
+    const char *traceName = NULL;
+    int threads = 1;
+    int writers = 1;
+    int direct = 0;
+    int format = LISTING_TEXT;
+    Listing *l = NULL;
+    const struct option longOptions[] = {
+        {"format", required_argument, NULL, 'F'},
+        {"trace", required_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    int ret;
+    int i;
 
-    if(do_traverse(r, "MxOb", get_track_info_cb, t, 0, t->index) < 0) {
-        goto error0;
+    if(argc < 3) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
     }
 
-    if(t->mxob == NULL) {
-        fprintf(stderr, "Failed to find MxOb.\n");
-        goto error0;
+    if(strcmp(argv[1], "list") == 0) {
+        extract = 0;
+    } else if(strcmp(argv[1], "extract") == 0) {
+        extract = 1;
+    } else if(strcmp(argv[1], "verify") == 0) {
+        extract = 1;
+        verify = 1;
+    } else if(strcmp(argv[1], "serve") == 0) {
+        extract = 0;
+        server = 1;
+    } else if(strcmp(argv[1], "subset") == 0) {
+        extract = 0;
+        subsetting = 1;
+    } else if(strcmp(argv[1], "check") == 0) {
+        extract = 0;
+        checking = 1;
+    } else {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
     }
 
-    if(isMuxed(t->mxob[0].trackType)) {
-        if(do_traverse(r, "MxChMxOb", get_track_info_cb, t, 0, t->index) < 0) {
-            goto error0;
+    /* options follow the command */
+    t.rle = 0;
+    t.frameIndex = 0;
+    t.pipeline = NULL;
+    t.dedup = NULL;
+    t.manifest = NULL;
+    t.fingerprint = 0;
+    t.verify = verify;
+    t.tracks = 0;
+    t.bytes = 0;
+    while((opt = getopt_long(argc - 1, &(argv[1]), "dfF:j:m:rt:uw:",
+                             longOptions, NULL)) != -1) {
+        switch(opt) {
+            case 'd':
+                direct = 1;
+                break;
+            case 'f':
+                t.frameIndex = 1;
+                break;
+            case 'F':
+                format = listing_format(optarg);
+                if(format < 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                if(threads < 1) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                manifestName = optarg;
+                break;
+            case 'r':
+                t.rle = 1;
+                break;
+            case 't':
+                tarName = optarg;
+                break;
+            case 'T':
+                traceName = optarg;
+                break;
+            case 'u':
+                dedup = 1;
+                break;
+            case 'w':
+                writers = atoi(optarg);
+                if(writers < 1 || writers > PIPELINE_MAX_WRITERS) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
         }
     }
-
-    /* some weird ones */
-    if(isMuxed(t->mxob[0].trackType)) {
-        if(do_traverse(r, "MxChMxChMxOb", get_track_info_cb, t, 0, t->index) < 0) {
-            goto error0;
-        }
+    if(optind + 1 >= argc) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
     }
-
-    /* some are even 3 deep! */
-    if(isMuxed(t->mxob[0].trackType)) {
-        if(do_traverse(r, "MxChMxChMxChMxOb", get_track_info_cb, t, 0, t->index) < 0) {
-            goto error0;
-        }
+    /* verify doesn't write anything */
+    if(verify && (direct || dedup || manifestName != NULL || tarName != NULL)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    /* outputs are looked at where they were written */
+    if(manifestName != NULL && tarName != NULL) {
+        fprintf(stderr, "A manifest can only be kept when writing files.\n");
+        exit(EXIT_FAILURE);
     }
 
-    for(i = 0; i < t->mxobs; i++) {
-        printf("Index: %d\n", i);
-        if(isMuxed(t->mxob[i].trackType)) {
-            printf("Muxed MxOb\n");
-        } else {
-            if(t->mxob[i].trackType == OMNI_TRACK_TYPE_WAVE) {
-                printf("WAVE MxOb\n");
-                printf("File name: %s\n",
-                       t->mxob[i].fileName);
-            } else {
-                printf("Raw file data MxOb\n");
-                printf("File name: %s\n",
-                       t->mxob[i].fileName);
-            }
+    /* only comes back if something went wrong */
+    if(server) {
+        if(optind + 2 >= argc || traceName != NULL) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
         }
-        print_mxob(&(t->mxob[i]));
-        printf("\n");
+        serve(argv[optind + 1], &(argv[optind + 2]), argc - optind - 2,
+              threads, writers);
+        exit(EXIT_FAILURE);
     }
 
-    t->chunks = 0;
-    t->c = NULL;
-
-    if(do_traverse(r, "MxDaMxCh", read_chunks_cb, t, 0, t->index) < 0) {
-        goto error1;
+    if(traceName != NULL && trace_open(traceName) < 0) {
+        exit(EXIT_FAILURE);
     }
 
-    printf("Read %d chunks.\n", t->chunks);
-
-    for(i = 0; i < t->chunks; i++) {
-        o = get_trackNum(t, t->c[i].trackNum);
-        if(o == NULL) {
-            fprintf(stderr, "Couldn't find object associated with track %u.\n",
-                            t->c[i].trackNum);
-            goto error2;
-        }
-
-        printf("%d: %d %d %d\n", i, o->trackNum, t->c[i].size, t->c[i].timestamp);
-
-        /* don't care about empty chunks */
-        if(t->c[i].chunkType == OMNI_CHUNK_TYPE_LAST) {
-            continue;
+    if(subsetting) {
+        if(optind + 3 >= argc) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
         }
-
-        /* not concerned about the container */
-        if(isMuxed(o->trackType)) {
-            continue;
+        ret = subset(argv[optind + 1], argv[optind + 2], &(argv[optind + 3]),
+                     argc - optind - 3, threads);
+        if(trace_close() < 0 || ret < 0) {
+            exit(EXIT_FAILURE);
         }
-
-        if(o->out == NULL) {
-            o->out = fopen(o->trackName, "wb");
-            if(o->out == NULL) {
-                fprintf(stderr, "Failed to open file %s for writing.\n", o->trackName);
-                goto error2;
-            }
-            printf("Opened %s.\n", o->trackName);
-
-            if(o->trackType == OMNI_TRACK_TYPE_WAVE) {
-                if(fwrite(&(o->wav), 1, sizeof(o->wav), o->out) < sizeof(o->wav)) {
-                    fprintf(stderr, "Failed to write WAV header.\n");
-                    goto error2;
-                }
-            } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP) {
-                if(fwrite(&(o->tga), 1, sizeof(o->tga), o->out) < sizeof(o->tga)) {
-                    fprintf(stderr, "Failed to write TGA header: %s\n", strerror(errno));
-                    goto error2;
-                }
-            } else { /* first chunk is always fully written */
-                body = &(t->c[i].data[OMNI_CHUNK_HEADER_SIZE]);
-                toWrite = t->c[i].size - OMNI_CHUNK_HEADER_SIZE;
-                if(fwrite(body, 1, toWrite, o->out) < toWrite) {
-                    fprintf(stderr, "Failed to write data: %s\n", strerror(errno));
-                    goto error2;
-                }
-            }
-        } else {
-            if(o->trackType == OMNI_TRACK_TYPE_RAW &&
-               !memcmp(o->format, FLCfmt, sizeof(FLCfmt))) {
-                /* further FLC chunks have some extra data */
-                body = &(t->c[i].data[OMNI_CHUNK_FLC_HEADER_SIZE + OMNI_CHUNK_HEADER_SIZE]);
-                toWrite = t->c[i].size - OMNI_CHUNK_FLC_HEADER_SIZE - OMNI_CHUNK_HEADER_SIZE;
-                if(fwrite(body, 1, toWrite, o->out) < toWrite) {
-                    fprintf(stderr, "Failed to write audio data: %s\n", strerror(errno));
-                    goto error2;
-                }
-            } else {
-                body = &(t->c[i].data[OMNI_CHUNK_HEADER_SIZE]);
-                toWrite = t->c[i].size - OMNI_CHUNK_HEADER_SIZE;
-                if(fwrite(body, 1, toWrite, o->out) < toWrite) {
-                    fprintf(stderr, "Failed to write audio data: %s\n", strerror(errno));
-                    goto error2;
-                }
-
-                if(o->trackType == OMNI_TRACK_TYPE_WAVE) {
-                    o->wav.dataSize += toWrite;
-                }
+        exit(EXIT_SUCCESS);
+    }
+
+    /* goes through every file even once one has problems */
+    if(checking) {
+        for(i = optind + 1; i < argc; i++) {
+            ret = check(argv[i], threads);
+            if(ret < 0) {
+                trace_close();
+                exit(EXIT_FAILURE);
+            } else if(ret > 0) {
+                failed = 1;
             }
         }
+        if(trace_close() < 0) {
+            exit(EXIT_FAILURE);
+        }
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
-    for(i = 0; i < t->mxobs; i++) {
-        if(t->mxob[i].trackType == OMNI_TRACK_TYPE_WAVE) {
-            t->mxob[i].wav.fileSize = t->mxob[i].wav.dataSize + WAV_FILE_SIZE_ADD;
-
-            if(fseeko(t->mxob[i].out, WAV_DATA_SIZE_OFFSET, SEEK_SET) < 0) {
-                fprintf(stderr, "Failed to seek to WAV data size offset.\n");
-                goto error2;
-            }
-            if(fwrite(&(t->mxob[i].wav.dataSize), 1, sizeof(int), t->mxob[i].out) < sizeof(int)) {
-                fprintf(stderr, "Failed to write WAV data size.\n");
-                goto error2;
-            }
-            if(fseeko(t->mxob[i].out, WAV_FILE_SIZE_OFFSET, SEEK_SET) < 0) {
-                fprintf(stderr, "Failed to seek to WAV file size offset.\n");
-                goto error2;
+    if(!extract) {
+        l = listing_open(format);
+        if(l == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if(verify) {
+            t.out = output_open_discard();
+        } else if(tarName != NULL) {
+            t.out = output_open_tar(tarName);
+        } else {
+            t.out = output_open_files(direct);
+        }
+        if(t.out == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        t.pipeline = pipeline_open(writers, 1);
+        if(t.pipeline == NULL) {
+            goto error0;
+        }
+        if(dedup) {
+            t.dedup = dedup_init();
+            if(t.dedup == NULL) {
+                goto error1;
             }
-            if(fwrite(&(t->mxob[i].wav.fileSize), 1, sizeof(int), t->mxob[i].out) < sizeof(int)) {
-                fprintf(stderr, "Failed to write WAV file size.\n");
+            /* files may still be linked together by the last run */
+            t.out->links = 1;
+        }
+        if(manifestName != NULL) {
+            t.manifest = manifest_open(manifestName);
+            if(t.manifest == NULL) {
                 goto error2;
             }
         }
-
-        if(t->mxob[i].out != NULL) {
-            fclose(t->mxob[i].out);
-        } else if(!isMuxed(t->mxob[i].trackType)) {
-            fprintf(stderr, "%s with track number %d never had any packets.\n",
-                            t->mxob[i].trackName, t->mxob[i].trackNum);
-        }
     }
 
-    printf("\n");
-
-    free(t->c);
-    free(t->mxob);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    return(0);
-
-error2:
-    for(i = 0; i < t->mxobs; i++) {
-        if(t->mxob[i].out != NULL) {
-            fclose(t->mxob[i].out);
+    /* later files can be linked to assets from earlier ones */
+    for(i = optind + 1; i < argc; i++) {
+        ret = process_file(&t, l, argv[i], extract, threads);
+        if(ret < 0) {
+            goto error3;
+        } else if(ret > 0) {
+            failed = 1;
         }
     }
-    free(t->c);
-error1:
-    free(t->mxob);
-error0:
-    return(-1);
-}
-
-void usage(const char *argv0) {
-    fprintf(stderr, "USAGE: %s <list|extract> <filename>\n", argv0);
-}
-
-int main(int argc, char **argv) {
-    RIFFFile *r;
-    int extract;
-    Track t;
 
-    if(argc < 3) {
-        usage(argv[0]);
-        exit(EXIT_FAILURE);
+    if(verify) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        seconds = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+        fprintf(stderr, "Verified %u tracks, %llu bytes in %.3f seconds",
+                        t.tracks, t.bytes, seconds);
+        if(seconds > 0) {
+            fprintf(stderr, ", %.1f MB/s", t.bytes / seconds / (1024 * 1024));
+        }
+        fprintf(stderr, ".\n");
     }
 
-    if(strcmp(argv[1], "list") == 0) {
-        extract = 0;
-    } else if(strcmp(argv[1], "extract") == 0) {
-        extract = 1;
-    } else {
-        usage(argv[0]);
-        exit(EXIT_FAILURE);
+    if(t.manifest != NULL) {
+        fprintf(stderr, "%u outputs were unchanged.\n", t.manifest->unchanged);
+        if(manifest_close(t.manifest) < 0) {
+            goto error2;
+        }
     }
-
-    r = riff_open(argv[2]);
-    if(r == NULL) {
-        fprintf(stderr, "Failed to open.\n");
-        exit(EXIT_FAILURE);
+    if(t.dedup != NULL) {
+        fprintf(stderr, "Linked %u duplicate assets, saving %llu bytes.\n",
+                        t.dedup->linked, t.dedup->saved);
+        dedup_free(t.dedup);
     }
-
-    if(extract == 0) {
-        if(riff_traverse(r, "", print_entry_cb, NULL) < 0) {
-            fprintf(stderr, "Failed to traverse file.\n");
+    if(extract) {
+        pipeline_close(t.pipeline);
+        if(output_close(t.out) < 0) {
+            exit(EXIT_FAILURE);
         }
     } else {
-        if(riff_traverse(r, "MxStMxSt", dump_song_cb, &t) < 0) {
-            fprintf(stderr, "Failed to traverse file.\n");
+        if(listing_close(l) < 0) {
+            exit(EXIT_FAILURE);
         }
     }
+    /* a trace is most wanted when something went wrong */
+    if(trace_close() < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    riff_close(r);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 
-    exit(EXIT_SUCCESS);
+error3:
+    /* what did get written is still skipped next time */
+    if(t.manifest != NULL) {
+        manifest_close(t.manifest);
+    }
+error2:
+    if(t.dedup != NULL) {
+        dedup_free(t.dedup);
+    }
+error1:
+    if(t.pipeline != NULL) {
+        pipeline_close(t.pipeline);
+    }
+error0:
+    if(extract) {
+        output_close(t.out);
+    } else {
+        listing_close(l);
+    }
+    trace_close();
+    exit(EXIT_FAILURE);
 }
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "riff.h"
+#include "stream.h"
+#include "hash.h"
+#include "output.h"
+#include "bitmap.h"
+#include "flc.h"
+#include "pipeline.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "song.h"
+#include "listing.h"
+#include "trace.h"
+
+/* Entries are listed the same way whether they came from an index or a
+   stream.  Output is put together in a big buffer and written when it fills,
+   rather than going through stdio a field at a time. */
+
+const char *ListingFormats[] = {"text", "json", "csv", "bin", NULL};
+
+int listing_format(const char *name) {
+    int i;
+
+    for(i = 0; ListingFormats[i] != NULL; i++) {
+        if(strcmp(name, ListingFormats[i]) == 0) {
+            return(i);
+        }
+    }
+
+    return(-1);
+}
+
+int listing_flush(Listing *l) {
+    if(write_all(STDOUT_FILENO, l->buf, l->len) < 0) {
+        fprintf(stderr, "Failed to write listing: %s\n", strerror(errno));
+        return(-1);
+    }
+    l->len = 0;
+
+    return(0);
+}
+
+/* make room for size more bytes */
+int listing_reserve(Listing *l, unsigned int size) {
+    if(l->len + size > LISTING_BUFFER_SIZE) {
+        return(listing_flush(l));
+    }
+
+    return(0);
+}
+
+int listing_put(Listing *l, const void *data, unsigned int size) {
+    if(listing_reserve(l, size) < 0) {
+        return(-1);
+    }
+    memcpy(&(l->buf[l->len]), data, size);
+    l->len += size;
+
+    return(0);
+}
+
+int listing_printf(Listing *l, const char *fmt, ...) {
+    va_list ap;
+    int ret;
+
+    if(listing_reserve(l, LISTING_FIELD_MAX) < 0) {
+        return(-1);
+    }
+    va_start(ap, fmt);
+    ret = vsnprintf((char *)&(l->buf[l->len]), LISTING_FIELD_MAX, fmt, ap);
+    va_end(ap);
+    if(ret < 0 || ret >= LISTING_FIELD_MAX) {
+        fprintf(stderr, "Listing field too long.\n");
+        return(-1);
+    }
+    l->len += ret;
+
+    return(0);
+}
+
+int listing_json_string(Listing *l, const char *s, unsigned int size) {
+    if(listing_reserve(l, JSON_STRING_MAX(size)) < 0) {
+        return(-1);
+    }
+    l->len += json_string((char *)&(l->buf[l->len]), s, size);
+
+    return(0);
+}
+
+int listing_csv_string(Listing *l, const char *s, unsigned int size) {
+    unsigned int i;
+
+    if(listing_reserve(l, size * 2 + 2) < 0) {
+        return(-1);
+    }
+
+    l->buf[l->len++] = '"';
+    for(i = 0; i < size; i++) {
+        if(s[i] == '"') {
+            l->buf[l->len++] = '"';
+        }
+        l->buf[l->len++] = s[i];
+    }
+    l->buf[l->len++] = '"';
+
+    return(0);
+}
+
+Listing *listing_open(int format) {
+    Listing *l;
+
+    l = malloc(sizeof(Listing));
+    if(l == NULL) {
+        fprintf(stderr, "Failed to allocate memory for listing.\n");
+        return(NULL);
+    }
+    l->format = format;
+    l->file = "";
+    l->len = 0;
+    song_init(&(l->t));
+    l->buf = malloc(LISTING_BUFFER_SIZE);
+    l->mxob = malloc(MXOB_MAX_SIZE);
+    if(l->buf == NULL || l->mxob == NULL) {
+        fprintf(stderr, "Failed to allocate memory for listing.\n");
+        goto error0;
+    }
+
+    if(format == LISTING_CSV &&
+       listing_printf(l, "file,depth,ent,node,start,offset,size,fourcc,"
+                         "name,type,track_num,file_name,format\n") < 0) {
+        goto error0;
+    }
+
+    return(l);
+
+error0:
+    free(l->buf);
+    free(l->mxob);
+    free(l);
+    return(NULL);
+}
+
+/* everything listed after this is from the SI called name */
+int listing_file(Listing *l, const char *name) {
+    unsigned int version = LISTING_VERSION;
+    unsigned short int nameLen = strlen(name);
+
+    l->file = name;
+
+    if(l->format == LISTING_BIN) {
+        if(listing_put(l, LISTING_MAGIC, 4) < 0 ||
+           listing_put(l, &version, sizeof(version)) < 0 ||
+           listing_put(l, &nameLen, sizeof(nameLen)) < 0 ||
+           listing_put(l, name, nameLen) < 0) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+/* the MxOb in an entry, if it is one and its data was read */
+MxOb *entry_mxob(Listing *l, const RIFFStreamEntry *e) {
+    if(e->key != MxOb_FOURCC || e->data == NULL) {
+        return(NULL);
+    }
+
+    /* only ever one at a time */
+    l->t.mxobs = 0;
+    if(populate_mxob(&(l->t), e->data, e->size) < 0) {
+        return(NULL);
+    }
+
+    return(&(l->t.mxob[0]));
+}
+
+int list_text(Listing *l, const RIFFStreamEntry *e) {
+    return(listing_printf(l, "%*c %3d %9u %9lu %8d %c%c%c%c\n",
+                          e->depth + 1, e->isNode ? 'd' : 'f',
+                          e->ent, e->start, (unsigned long)(e->offset - 12),
+                          e->size,
+                          FOURCC_CHAR(e->key, 0), FOURCC_CHAR(e->key, 1),
+                          FOURCC_CHAR(e->key, 2), FOURCC_CHAR(e->key, 3)));
+}
+
+int list_json(Listing *l, const RIFFStreamEntry *e, const MxOb *o) {
+    if(listing_printf(l, "{\"file\":") < 0 ||
+       listing_json_string(l, l->file, strlen(l->file)) < 0 ||
+       listing_printf(l, ",\"depth\":%d,\"ent\":%d,\"node\":%s,\"start\":%u,"
+                         "\"offset\":%lld,\"size\":%u,\"fourcc\":",
+                      e->depth, e->ent, e->isNode ? "true" : "false",
+                      e->start, (long long)e->offset, e->size) < 0 ||
+       listing_json_string(l, (const char *)&(e->key), 4) < 0) {
+        return(-1);
+    }
+
+    if(o != NULL) {
+        if(listing_printf(l, ",\"name\":") < 0 ||
+           listing_json_string(l, o->trackName, strlen(o->trackName)) < 0 ||
+           listing_printf(l, ",\"type\":%d,\"trackNum\":%u",
+                          o->trackType, o->trackNum) < 0) {
+            return(-1);
+        }
+        if(!isMuxed(o->trackType)) {
+            if(listing_printf(l, ",\"fileName\":") < 0 ||
+               listing_json_string(l, o->fileName, strlen(o->fileName)) < 0 ||
+               listing_printf(l, ",\"format\":") < 0 ||
+               listing_json_string(l, o->format, sizeof(o->format)) < 0) {
+                return(-1);
+            }
+        }
+    }
+
+    return(listing_printf(l, "}\n"));
+}
+
+int list_csv(Listing *l, const RIFFStreamEntry *e, const MxOb *o) {
+    if(listing_csv_string(l, l->file, strlen(l->file)) < 0 ||
+       listing_printf(l, ",%d,%d,%d,%u,%lld,%u,",
+                      e->depth, e->ent, e->isNode, e->start,
+                      (long long)e->offset, e->size) < 0 ||
+       listing_csv_string(l, (const char *)&(e->key), 4) < 0) {
+        return(-1);
+    }
+
+    if(o == NULL) {
+        return(listing_printf(l, ",,,,,\n"));
+    }
+
+    if(listing_printf(l, ",") < 0 ||
+       listing_csv_string(l, o->trackName, strlen(o->trackName)) < 0 ||
+       listing_printf(l, ",%d,%u,", o->trackType, o->trackNum) < 0) {
+        return(-1);
+    }
+    if(isMuxed(o->trackType)) {
+        return(listing_printf(l, ",\n"));
+    }
+    if(listing_csv_string(l, o->fileName, strlen(o->fileName)) < 0 ||
+       listing_printf(l, ",") < 0 ||
+       listing_csv_string(l, o->format, sizeof(o->format)) < 0) {
+        return(-1);
+    }
+
+    return(listing_printf(l, "\n"));
+}
+
+int list_bin(Listing *l, const RIFFStreamEntry *e, const MxOb *o) {
+    unsigned int ent = e->ent;
+    long long offset = e->offset;
+    unsigned short int depth = e->depth;
+    unsigned char flags[2];
+    unsigned char nameLen;
+    unsigned short int fileNameLen;
+    char format[4] = {0, 0, 0, 0};
+
+    flags[0] = e->isNode;
+    flags[1] = o != NULL;
+    if(listing_put(l, &(e->key), 4) < 0 ||
+       listing_put(l, &ent, 4) < 0 ||
+       listing_put(l, &(e->start), 4) < 0 ||
+       listing_put(l, &(e->size), 4) < 0 ||
+       listing_put(l, &offset, 8) < 0 ||
+       listing_put(l, &depth, 2) < 0 ||
+       listing_put(l, flags, 2) < 0) {
+        return(-1);
+    }
+    if(o == NULL) {
+        return(0);
+    }
+
+    nameLen = strlen(o->trackName);
+    fileNameLen = 0;
+    if(!isMuxed(o->trackType)) {
+        fileNameLen = strlen(o->fileName);
+        memcpy(format, o->format, sizeof(format));
+    }
+    if(listing_put(l, &(o->trackType), 2) < 0 ||
+       listing_put(l, &(o->trackNum), 4) < 0 ||
+       listing_put(l, format, 4) < 0 ||
+       listing_put(l, &nameLen, 1) < 0 ||
+       listing_put(l, o->trackName, nameLen) < 0 ||
+       listing_put(l, &fileNameLen, 2) < 0 ||
+       listing_put(l, o->fileName, fileNameLen) < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+int listing_entry(Listing *l, const RIFFStreamEntry *e) {
+    MxOb *o;
+
+    if(l->format == LISTING_TEXT) {
+        return(list_text(l, e));
+    }
+
+    o = entry_mxob(l, e);
+    switch(l->format) {
+        case LISTING_JSON:
+            return(list_json(l, e, o));
+        case LISTING_CSV:
+            return(list_csv(l, e, o));
+        default:
+            return(list_bin(l, e, o));
+    }
+}
+
+int listing_stream_cb(const RIFFStreamEntry *e, void *priv) {
+    return(listing_entry(priv, e));
+}
+
+/* offsets are carried down from the parent rather than worked out again for
+   every entry */
+int listing_walk(Listing *l, RIFFFile *r, int index,
+                 const RIFFStreamEntry *parent) {
+    RIFFStreamEntry e;
+    const RIFFType *type;
+    int entries;
+    int child;
+    int i;
+
+    entries = riff_entries(r, index);
+    for(i = 0; i < entries; i++) {
+        child = RIFF_ENTRY(r, index, i);
+        type = RIFF_TYPE(r, child);
+
+        e.fourCC = type->fourCC;
+        e.fourCC2 = type->fourCC2;
+        e.key = type->key;
+        e.isNode = type->isNode;
+        e.depth = parent->depth + 1;
+        e.ent = i;
+        e.start = r->start[child];
+        e.offset = parent->offset + r->start[child];
+        e.size = r->size[child];
+        e.data = NULL;
+        e.path = NULL;
+
+        /* only MxObs are looked in to, and only for the formats that have
+           their fields */
+        if(l->format != LISTING_TEXT && e.key == MxOb_FOURCC &&
+           e.size <= MXOB_MAX_SIZE) {
+            if(pread_all(fileno(r->f), l->mxob, e.size, e.offset) < 0) {
+                return(-1);
+            }
+            e.data = l->mxob;
+        }
+
+        if(listing_entry(l, &e) < 0) {
+            return(-1);
+        }
+        if(e.isNode && listing_walk(l, r, child, &e) < 0) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+int listing_index(Listing *l, RIFFFile *r) {
+    RIFFStreamEntry root;
+
+    root.depth = 0;
+    root.offset = r->start[0];
+
+    return(listing_walk(l, r, 0, &root));
+}
+
+/* write out what's left and free the listing */
+int listing_close(Listing *l) {
+    int ret;
+
+    ret = listing_flush(l);
+
+    song_free(&(l->t));
+    free(l->buf);
+    free(l->mxob);
+    free(l);
+
+    return(ret);
+}
@@ -0,0 +1,58 @@
+#define LISTING_BUFFER_SIZE (1024 * 1024)
+/* longest single field, name and file name are the biggest */
+#define LISTING_FIELD_MAX (1024)
+
+#define LISTING_TEXT (0)
+#define LISTING_JSON (1)
+#define LISTING_CSV  (2)
+#define LISTING_BIN  (3)
+
+/* The binary listing is little endian and packed.  Each SI starts with
+
+   4 bytes     "LIXL"
+   4 bytes     version, 1
+   2 bytes     length of the SI's name
+   n bytes     the SI's name
+
+   followed by a record for each entry, which never start with "LIXL":
+
+   4 bytes     fourCC, the second one for LISTs
+   4 bytes     number within its parent
+   4 bytes     start relative to its parent
+   4 bytes     size
+   8 bytes     absolute offset of the data
+   2 bytes     depth, children of the root are 1
+   1 byte      1 for nodes
+   1 byte      1 if MxOb fields follow
+
+   MxOb fields:
+   2 bytes     track type
+   4 bytes     track number
+   4 bytes     format, all 0 for muxed MxObs
+   1 byte      length of the name
+   n bytes     name
+   2 bytes     length of the file name
+   n bytes     file name */
+#define LISTING_MAGIC "LIXL"
+#define LISTING_VERSION (1)
+
+typedef struct {
+    int format;
+    const char *file;
+
+    /* output is gathered and written in big blocks */
+    unsigned char *buf;
+    unsigned int len;
+
+    /* for reading MxObs in to */
+    Track t;
+    unsigned char *mxob;
+} Listing;
+
+int listing_format(const char *name);
+Listing *listing_open(int format);
+int listing_file(Listing *l, const char *name);
+int listing_entry(Listing *l, const RIFFStreamEntry *e);
+int listing_stream_cb(const RIFFStreamEntry *e, void *priv);
+int listing_index(Listing *l, RIFFFile *r);
+int listing_close(Listing *l);
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "output.h"
+#include "manifest.h"
+
+/* What was written last time, so outputs which would come out the same can be
+   left alone.  One line per output:
+
+   <SI fingerprint> <song> <track num> <size> <hash> <mtime> <name>
+
+   An SI which hasn't changed since gives the same outputs, so those only have
+   to be found untouched.  Otherwise outputs are checked against the hash of
+   what would be written now. */
+
+long long stat_mtime(const struct stat *st) {
+    return((long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec);
+}
+
+/* where an entry with this name is, or the empty slot it would go in */
+unsigned int *manifest_slot(Manifest *m, const char *name) {
+    unsigned int i = hash_string(name) & (m->slots - 1);
+
+    for(;; i = (i + 1) & (m->slots - 1)) {
+        if(m->slot[i] == 0 ||
+           strcmp(m->entry[m->slot[i] - 1].name, name) == 0) {
+            return(&(m->slot[i]));
+        }
+    }
+}
+
+/* table is kept at most half full */
+int manifest_grow(Manifest *m) {
+    unsigned int *slot;
+    unsigned int i;
+
+    slot = calloc(m->slots * 2, sizeof(unsigned int));
+    if(slot == NULL) {
+        fprintf(stderr, "Failed to allocate memory to grow manifest.\n");
+        return(-1);
+    }
+    free(m->slot);
+    m->slot = slot;
+    m->slots *= 2;
+
+    for(i = 0; i < m->entries; i++) {
+        *manifest_slot(m, m->entry[i].name) = i + 1;
+    }
+
+    return(0);
+}
+
+/* the entry for name, added if there isn't one */
+ManifestEntry *manifest_add(Manifest *m, const char *name) {
+    unsigned int *slot;
+    ManifestEntry *e;
+
+    if(strlen(name) >= sizeof(e->name)) {
+        fprintf(stderr, "Name too long for manifest: %s\n", name);
+        return(NULL);
+    }
+
+    slot = manifest_slot(m, name);
+    if(*slot != 0) {
+        return(&(m->entry[*slot - 1]));
+    }
+
+    if((m->entries + 1) * 2 > m->slots) {
+        if(manifest_grow(m) < 0) {
+            return(NULL);
+        }
+        slot = manifest_slot(m, name);
+    }
+    if(m->entries == m->entryMem) {
+        e = realloc(m->entry, sizeof(ManifestEntry) * (m->entryMem + m->slots));
+        if(e == NULL) {
+            fprintf(stderr, "Failed to allocate memory to grow manifest.\n");
+            return(NULL);
+        }
+        m->entry = e;
+        m->entryMem += m->slots;
+    }
+
+    e = &(m->entry[m->entries]);
+    strncpy(e->name, name, sizeof(e->name));
+    m->entries++;
+    *slot = m->entries;
+
+    return(e);
+}
+
+int manifest_load(Manifest *m) {
+    FILE *in;
+    char line[MANIFEST_LINE_MAX];
+    ManifestEntry l;
+    ManifestEntry *e;
+    unsigned int lineNum = 0;
+    int nameStart;
+
+    in = fopen(m->filename, "r");
+    if(in == NULL) {
+        /* nothing was written yet */
+        if(errno == ENOENT) {
+            return(0);
+        }
+        fprintf(stderr, "Failed to open manifest %s: %s\n",
+                        m->filename, strerror(errno));
+        return(-1);
+    }
+
+    while(fgets(line, sizeof(line), in) != NULL) {
+        lineNum++;
+        line[strcspn(line, "\n")] = '\0';
+
+        if(sscanf(line, "%llx %d %u %u %llx %lld %n", &(l.fingerprint),
+                  &(l.song), &(l.trackNum), &(l.size), &(l.hash), &(l.mtime),
+                  &nameStart) < 6 || line[nameStart] == '\0') {
+            fprintf(stderr, "Bad line %u in manifest %s.\n", lineNum, m->filename);
+            goto error0;
+        }
+
+        e = manifest_add(m, &(line[nameStart]));
+        if(e == NULL) {
+            goto error0;
+        }
+        strncpy(l.name, e->name, sizeof(l.name));
+        *e = l;
+    }
+    if(ferror(in)) {
+        fprintf(stderr, "Failed to read manifest %s.\n", m->filename);
+        goto error0;
+    }
+
+    fclose(in);
+
+    return(0);
+
+error0:
+    fclose(in);
+    return(-1);
+}
+
+void manifest_free(Manifest *m) {
+    free(m->filename);
+    free(m->slot);
+    free(m->entry);
+    free(m);
+}
+
+Manifest *manifest_open(const char *filename) {
+    Manifest *m;
+
+    m = malloc(sizeof(Manifest));
+    if(m == NULL) {
+        fprintf(stderr, "Failed to allocate memory for manifest.\n");
+        return(NULL);
+    }
+    m->entry = NULL;
+    m->entries = 0;
+    m->entryMem = 0;
+    m->slots = MANIFEST_INITIAL_SLOTS;
+    m->unchanged = 0;
+    m->filename = strdup(filename);
+    m->slot = calloc(m->slots, sizeof(unsigned int));
+    if(m->filename == NULL || m->slot == NULL) {
+        fprintf(stderr, "Failed to allocate memory for manifest.\n");
+        goto error0;
+    }
+
+    if(manifest_load(m) < 0) {
+        goto error0;
+    }
+
+    return(m);
+
+error0:
+    manifest_free(m);
+    return(NULL);
+}
+
+/* stands in for the contents of an SI, it's taken to be the same as long as
+   it's the same file and hasn't been modified.  the options which change what
+   is written are part of it too, so outputs of a run with different ones are
+   never taken to be unchanged. */
+unsigned long long manifest_fingerprint(int fd, int rle, int frameIndex) {
+    struct stat st;
+    long long stamp[6];
+    Hash h;
+
+    if(fstat(fd, &st) < 0) {
+        fprintf(stderr, "Failed to stat SI: %s\n", strerror(errno));
+        return(0);
+    }
+    stamp[0] = st.st_dev;
+    stamp[1] = st.st_ino;
+    stamp[2] = st.st_size;
+    stamp[3] = stat_mtime(&st);
+    stamp[4] = rle;
+    stamp[5] = frameIndex;
+
+    hash_init(&h);
+    hash_update(&h, stamp, sizeof(stamp));
+    return(hash_final(&h));
+}
+
+ManifestEntry *manifest_find(Manifest *m, const char *name) {
+    unsigned int slot;
+
+    slot = *manifest_slot(m, name);
+    if(slot == 0) {
+        return(NULL);
+    }
+
+    return(&(m->entry[slot - 1]));
+}
+
+/* the output is still there and hasn't been touched since it was written */
+int manifest_unchanged(const ManifestEntry *e) {
+    struct stat st;
+
+    if(stat(e->name, &st) < 0) {
+        return(0);
+    }
+
+    return(S_ISREG(st.st_mode) && st.st_size == e->size &&
+           stat_mtime(&st) == e->mtime);
+}
+
+/* remember the output name was written from here, as it is now */
+int manifest_update(Manifest *m, const char *name,
+                    unsigned long long fingerprint, int song,
+                    unsigned int trackNum, unsigned int size,
+                    unsigned long long hash) {
+    struct stat st;
+    ManifestEntry *e;
+
+    if(stat(name, &st) < 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", name, strerror(errno));
+        return(-1);
+    }
+
+    e = manifest_add(m, name);
+    if(e == NULL) {
+        return(-1);
+    }
+    e->fingerprint = fingerprint;
+    e->song = song;
+    e->trackNum = trackNum;
+    e->size = size;
+    e->hash = hash;
+    e->mtime = stat_mtime(&st);
+
+    return(0);
+}
+
+/* write the manifest out in place of the old one and free it */
+int manifest_close(Manifest *m) {
+    FILE *out;
+    char *tmpName;
+    ManifestEntry *e;
+    unsigned int i;
+
+    tmpName = malloc(strlen(m->filename) + sizeof(".tmp"));
+    if(tmpName == NULL) {
+        fprintf(stderr, "Failed to allocate memory for manifest name.\n");
+        goto error0;
+    }
+    sprintf(tmpName, "%s.tmp", m->filename);
+
+    out = fopen(tmpName, "w");
+    if(out == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", tmpName, strerror(errno));
+        goto error1;
+    }
+
+    for(i = 0; i < m->entries; i++) {
+        e = &(m->entry[i]);
+        fprintf(out, "%016llx %d %u %u %016llx %lld %s\n", e->fingerprint,
+                e->song, e->trackNum, e->size, e->hash, e->mtime, e->name);
+    }
+
+    if(fclose(out) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", tmpName, strerror(errno));
+        goto error2;
+    }
+    if(rename(tmpName, m->filename) < 0) {
+        fprintf(stderr, "Failed to replace %s: %s\n", m->filename, strerror(errno));
+        goto error2;
+    }
+
+    free(tmpName);
+    manifest_free(m);
+
+    return(0);
+
+error2:
+    unlink(tmpName);
+error1:
+    free(tmpName);
+error0:
+    manifest_free(m);
+    return(-1);
+}
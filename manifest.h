@@ -0,0 +1,43 @@
+#define MANIFEST_INITIAL_SLOTS (1024)
+#define MANIFEST_LINE_MAX (OUTPUT_NAME_MAX + 128)
+
+/* an output as it was when it was last written */
+typedef struct {
+    char name[OUTPUT_NAME_MAX];
+
+    /* SI it came from, and where in it */
+    unsigned long long fingerprint;
+    int song;
+    unsigned int trackNum;
+
+    unsigned int size;
+    unsigned long long hash;
+
+    /* of the file after it was written, so it can be told it was left alone */
+    long long mtime;
+} ManifestEntry;
+
+typedef struct {
+    char *filename;
+
+    ManifestEntry *entry;
+    unsigned int entries;
+    unsigned int entryMem;
+
+    /* open addressed table of entry indexes + 1, by name */
+    unsigned int *slot;
+    unsigned int slots;
+
+    /* outputs which didn't need writing again */
+    unsigned int unchanged;
+} Manifest;
+
+Manifest *manifest_open(const char *filename);
+unsigned long long manifest_fingerprint(int fd, int rle, int frameIndex);
+ManifestEntry *manifest_find(Manifest *m, const char *name);
+int manifest_unchanged(const ManifestEntry *e);
+int manifest_update(Manifest *m, const char *name,
+                    unsigned long long fingerprint, int song,
+                    unsigned int trackNum, unsigned int size,
+                    unsigned long long hash);
+int manifest_close(Manifest *m);
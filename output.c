@@ -0,0 +1,592 @@
+/* for O_DIRECT */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "hash.h"
+#include "output.h"
+
+typedef struct __attribute__((packed)) {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+const char zeroBlock[TAR_BLOCK_SIZE] = {0};
+
+/* short writes only happen on errors or pipes, but either way keep going until
+   it's all out or it fails. */
+int write_all(int fd, const void *data, unsigned int size) {
+    ssize_t ret;
+
+    while(size > 0) {
+        ret = write(fd, data, size);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return(-1);
+        }
+        data = (const char *)data + ret;
+        size -= ret;
+    }
+
+    return(0);
+}
+
+int pwrite_all(int fd, const void *data, unsigned int size, off_t pos) {
+    ssize_t ret;
+
+    while(size > 0) {
+        ret = pwrite(fd, data, size, pos);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return(-1);
+        }
+        data = (const char *)data + ret;
+        size -= ret;
+        pos += ret;
+    }
+
+    return(0);
+}
+
+/* the same, but for gathering a few pieces in to one call, to pos if it isn't
+   negative */
+int writev_all(int fd, struct iovec *iov, int count, off_t pos) {
+    ssize_t ret;
+
+    while(count > 0) {
+        if(pos < 0) {
+            ret = writev(fd, iov, count);
+        } else {
+            ret = pwritev(fd, iov, count, pos);
+        }
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return(-1);
+        }
+        if(pos >= 0) {
+            pos += ret;
+        }
+
+        while(count > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return(0);
+}
+
+Output *output_init() {
+    Output *o;
+
+    o = malloc(sizeof(Output));
+    if(o == NULL) {
+        fprintf(stderr, "Failed to allocate memory for Output.\n");
+        return(NULL);
+    }
+    o->tar = -1;
+    o->seekable = 0;
+    o->pos = 0;
+    o->direct = 0;
+    o->raw = 0;
+    o->discard = 0;
+    o->links = 0;
+
+    return(o);
+}
+
+/* direct skips the page cache, for when the output is much bigger than it */
+Output *output_open_files(int direct) {
+    Output *o;
+
+    o = output_init();
+    if(o != NULL) {
+        o->direct = direct;
+    }
+
+    return(o);
+}
+
+Output *output_open_tar(const char *filename) {
+    Output *o;
+    struct stat st;
+
+    o = output_init();
+    if(o == NULL) {
+        return(NULL);
+    }
+
+    if(strcmp(filename, "-") == 0) {
+        /* progress messages go to stdout, so move them out of the way of the
+           archive. */
+        o->tar = dup(STDOUT_FILENO);
+        if(o->tar < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "Failed to redirect stdout: %s\n", strerror(errno));
+            goto error0;
+        }
+    } else {
+        o->tar = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(o->tar < 0) {
+            fprintf(stderr, "Failed to open %s for writing.\n", filename);
+            goto error0;
+        }
+    }
+
+    /* stdout may well be a regular file too */
+    if(fstat(o->tar, &st) == 0 && S_ISREG(st.st_mode)) {
+        o->pos = lseek(o->tar, 0, SEEK_CUR);
+        if(o->pos >= 0) {
+            o->seekable = 1;
+        } else {
+            o->pos = 0;
+        }
+    }
+
+    return(o);
+
+error0:
+    free(o);
+    return(NULL);
+}
+
+/* assets go out as they are to fd, which is closed with the Output */
+Output *output_open_stream(int fd) {
+    Output *o;
+
+    o = output_init();
+    if(o != NULL) {
+        o->tar = fd;
+        o->raw = 1;
+    }
+
+    return(o);
+}
+
+/* for finding out what would be written */
+Output *output_open_discard() {
+    Output *o;
+
+    o = output_init();
+    if(o != NULL) {
+        o->discard = 1;
+    }
+
+    return(o);
+}
+
+/* whether assets can be written out of order and at the same time */
+int output_positional(Output *o) {
+    return(o->tar < 0 || o->seekable);
+}
+
+/* whether an asset can still be replaced with a link once it's written, an
+   archive can't take back a member */
+int output_relinkable(Output *o) {
+    return(o->tar < 0 && !o->discard);
+}
+
+int tar_write_header(Output *o, const char *name, unsigned int size,
+                     const char *link, off_t pos) {
+    TarHeader h;
+    unsigned int chksum = 0;
+    unsigned int i;
+    int ret;
+
+    if(strlen(name) >= sizeof(h.name)) {
+        fprintf(stderr, "Name too long for tar header: %s\n", name);
+        return(-1);
+    }
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name));
+    snprintf(h.mode, sizeof(h.mode), "%07o", 0644);
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011o", size);
+    snprintf(h.mtime, sizeof(h.mtime), "%011lo", (unsigned long)time(NULL));
+    h.typeflag = '0';
+    if(link != NULL) {
+        if(strlen(link) >= sizeof(h.linkname)) {
+            fprintf(stderr, "Link name too long for tar header: %s\n", link);
+            return(-1);
+        }
+        h.typeflag = '1';
+        strncpy(h.linkname, link, sizeof(h.linkname));
+    }
+    memcpy(h.magic, "ustar", sizeof(h.magic));
+    memcpy(h.version, "00", sizeof(h.version));
+
+    /* checksum is calculated with the checksum field filled with spaces */
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    for(i = 0; i < sizeof(h); i++) {
+        chksum += ((unsigned char *)&h)[i];
+    }
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", chksum);
+
+    if(pos < 0) {
+        ret = write_all(o->tar, &h, sizeof(h));
+    } else {
+        ret = pwrite_all(o->tar, &h, sizeof(h), pos);
+    }
+    if(ret < 0) {
+        fprintf(stderr, "Failed to write tar header: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+int output_asset_init(Output *o, OutputAsset *a, const char *name,
+                      unsigned int size) {
+    if(strlen(name) >= sizeof(a->name)) {
+        fprintf(stderr, "Asset name too long: %s\n", name);
+        return(-1);
+    }
+    strncpy(a->name, name, sizeof(a->name));
+    a->size = size;
+    a->written = 0;
+    a->state = OUTPUT_ASSET_NEW;
+    a->fd = -1;
+    a->base = -1;
+    a->buf = NULL;
+    a->bufOffset = 0;
+    a->bufLen = 0;
+    a->direct = 0;
+    hash_init(&(a->hash));
+    a->hashed = 0;
+
+    if(o->discard) {
+        a->state = OUTPUT_ASSET_OPEN;
+    } else if(o->tar < 0) {
+        if(o->links) {
+            unlink(name);
+        }
+        if(o->direct) {
+            a->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+            a->direct = (a->fd >= 0);
+        }
+        /* not every filesystem can do it */
+        if(a->fd < 0) {
+            a->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if(a->fd < 0) {
+            fprintf(stderr, "Failed to open file %s for writing.\n", name);
+            return(-1);
+        }
+        a->state = OUTPUT_ASSET_OPEN;
+    } else if(o->seekable) {
+        /* reserve the member now so its data can go in whenever it's ready */
+        if(tar_write_header(o, name, size, NULL, o->pos) < 0) {
+            return(-1);
+        }
+        a->base = o->pos + TAR_BLOCK_SIZE;
+        o->pos = a->base + size +
+                 (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+        a->state = OUTPUT_ASSET_OPEN;
+    }
+
+    return(0);
+}
+
+/* write out what's been gathered followed by extra, which is either too big
+   to be gathered or the padding at the end of an archive member. */
+int asset_flush(Output *o, OutputAsset *a, const void *extra,
+                unsigned int extraSize) {
+    struct iovec iov[2];
+    int count = 0;
+    int ret;
+
+    if(a->bufLen > 0) {
+        iov[count].iov_base = a->buf;
+        iov[count].iov_len = a->bufLen;
+        count++;
+    }
+    if(extraSize > 0) {
+        iov[count].iov_base = (void *)extra;
+        iov[count].iov_len = extraSize;
+        count++;
+    }
+    if(count == 0) {
+        return(0);
+    }
+
+    /* direct writes have to be aligned and come from the aligned buffer, so
+       anything else, like the end of the file, goes through the cache. */
+    if(a->direct && (extraSize > 0 ||
+                     a->bufOffset % OUTPUT_ALIGN != 0 ||
+                     a->bufLen % OUTPUT_ALIGN != 0)) {
+        if(fcntl(a->fd, F_SETFL, fcntl(a->fd, F_GETFL) & ~O_DIRECT) < 0) {
+            fprintf(stderr, "Failed to turn off direct writes: %s\n",
+                            strerror(errno));
+            return(-1);
+        }
+        a->direct = 0;
+    }
+
+    if(o->tar < 0) {
+        ret = writev_all(a->fd, iov, count, a->bufOffset);
+    } else if(o->seekable) {
+        ret = writev_all(o->tar, iov, count, a->base + a->bufOffset);
+    } else {
+        ret = writev_all(o->tar, iov, count, -1);
+    }
+    if(ret < 0) {
+        fprintf(stderr, "Failed to write data: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    a->bufOffset += a->bufLen + extraSize;
+    a->bufLen = 0;
+
+    return(0);
+}
+
+int asset_finish(Output *o, OutputAsset *a) {
+    unsigned int padding = 0;
+    int ret;
+
+    a->state = OUTPUT_ASSET_DONE;
+    if(o->discard) {
+        return(0);
+    }
+
+    /* padding in a seekable archive is left as a hole */
+    if(o->tar >= 0 && !o->seekable && !o->raw) {
+        padding = (TAR_BLOCK_SIZE - (a->size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    }
+    ret = asset_flush(o, a, zeroBlock, padding);
+    free(a->buf);
+    a->buf = NULL;
+    if(ret < 0) {
+        return(-1);
+    }
+
+    if(o->tar < 0) {
+        if(close(a->fd) < 0) {
+            fprintf(stderr, "Failed to close output file: %s\n", strerror(errno));
+            return(-1);
+        }
+        a->fd = -1;
+    }
+
+    return(0);
+}
+
+/* Writes are gathered per asset and go out when they stop following on from
+   each other or the buffer fills.  An asset may be written to from any one
+   thread at a time, but different assets may be written at the same time
+   when output_positional() says so. */
+int output_asset_write(Output *o, OutputAsset *a, const void *data,
+                       unsigned int size, unsigned int offset) {
+    unsigned int bufSize;
+    unsigned int count;
+
+    if(a->state == OUTPUT_ASSET_DONE || offset + size > a->size) {
+        fprintf(stderr, "%s data exceeds its computed size.\n", a->name);
+        return(-1);
+    }
+
+    if(a->state == OUTPUT_ASSET_NEW) {
+        /* archive stream, members have to go out whole and in order */
+        if(!o->raw && tar_write_header(o, a->name, a->size, NULL, -1) < 0) {
+            return(-1);
+        }
+        a->state = OUTPUT_ASSET_OPEN;
+    }
+
+    /* pieces of an asset are normally written in order, so they can be hashed
+       as they go by */
+    if(size > 0 && offset == a->hashed) {
+        hash_update(&(a->hash), data, size);
+        a->hashed += size;
+    }
+    if(o->discard) {
+        a->written += size;
+        if(a->written == a->size) {
+            return(asset_finish(o, a));
+        }
+        return(0);
+    }
+
+    if(o->tar >= 0 && !o->seekable && offset != a->written) {
+        fprintf(stderr, "%s written out of order to an archive stream.\n",
+                        a->name);
+        return(-1);
+    }
+
+    if(offset != a->bufOffset + a->bufLen) {
+        if(asset_flush(o, a, NULL, 0) < 0) {
+            return(-1);
+        }
+        a->bufOffset = offset;
+    }
+
+    /* small assets don't need the whole buffer */
+    bufSize = a->size < OUTPUT_BUFFER_SIZE ? a->size : OUTPUT_BUFFER_SIZE;
+    bufSize = (bufSize + OUTPUT_ALIGN - 1) / OUTPUT_ALIGN * OUTPUT_ALIGN;
+    if(a->buf == NULL && size > 0 &&
+       posix_memalign((void **)&(a->buf), OUTPUT_ALIGN, bufSize) != 0) {
+        a->buf = NULL;
+        fprintf(stderr, "Failed to allocate memory for %s.\n", a->name);
+        return(-1);
+    }
+
+    a->written += size;
+    while(size > 0) {
+        if(a->bufLen == 0 && size >= bufSize && !a->direct) {
+            /* too big to be worth gathering */
+            if(asset_flush(o, a, data, size) < 0) {
+                return(-1);
+            }
+            break;
+        }
+
+        count = bufSize - a->bufLen;
+        if(count > size) {
+            count = size;
+        }
+        memcpy(&(a->buf[a->bufLen]), data, count);
+        a->bufLen += count;
+        data = (const unsigned char *)data + count;
+        size -= count;
+
+        if(a->bufLen == bufSize && asset_flush(o, a, NULL, 0) < 0) {
+            return(-1);
+        }
+    }
+
+    if(a->written == a->size) {
+        return(asset_finish(o, a));
+    }
+
+    return(0);
+}
+
+/* called once nothing more will be written, catches assets that came up
+   short and cleans up after them */
+int output_asset_end(Output *o, OutputAsset *a) {
+    if(a->state == OUTPUT_ASSET_DONE) {
+        return(0);
+    }
+
+    /* empty, so nothing was ever written to it */
+    if(a->written == a->size) {
+        if(a->state == OUTPUT_ASSET_NEW) {
+            return(output_asset_write(o, a, NULL, 0, 0));
+        }
+        return(asset_finish(o, a));
+    }
+
+    fprintf(stderr, "%s is %u bytes short of its computed size.\n",
+                    a->name, a->size - a->written);
+    if(a->fd >= 0) {
+        close(a->fd);
+        a->fd = -1;
+    }
+    free(a->buf);
+    a->buf = NULL;
+    a->state = OUTPUT_ASSET_DONE;
+
+    return(-1);
+}
+
+/* name is the same as target, a hard link for files or a link member in an
+   archive */
+int output_link(Output *o, const char *name, const char *target) {
+    if(o->discard) {
+        return(0);
+    } else if(o->raw) {
+        fprintf(stderr, "Can't link %s in a stream.\n", name);
+        return(-1);
+    } else if(o->tar < 0) {
+        if(unlink(name) < 0 && errno != ENOENT) {
+            fprintf(stderr, "Failed to remove %s: %s\n", name, strerror(errno));
+            return(-1);
+        }
+        if(link(target, name) < 0) {
+            fprintf(stderr, "Failed to link %s to %s: %s\n",
+                            name, target, strerror(errno));
+            return(-1);
+        }
+        o->links = 1;
+    } else if(o->seekable) {
+        if(tar_write_header(o, name, 0, target, o->pos) < 0) {
+            return(-1);
+        }
+        o->pos += TAR_BLOCK_SIZE;
+    } else {
+        if(tar_write_header(o, name, 0, target, -1) < 0) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+int output_close(Output *o) {
+    int ret = 0;
+
+    if(o->tar < 0) {
+        free(o);
+        return(0);
+    }
+
+    /* end of archive is marked by two empty blocks */
+    if(!o->raw && o->seekable) {
+        ret = pwrite_all(o->tar, zeroBlock, sizeof(zeroBlock), o->pos);
+        if(ret == 0) {
+            ret = pwrite_all(o->tar, zeroBlock, sizeof(zeroBlock),
+                             o->pos + TAR_BLOCK_SIZE);
+        }
+    } else if(!o->raw) {
+        ret = write_all(o->tar, zeroBlock, sizeof(zeroBlock));
+        if(ret == 0) {
+            ret = write_all(o->tar, zeroBlock, sizeof(zeroBlock));
+        }
+    }
+    if(ret < 0) {
+        fprintf(stderr, "Failed to write end of archive: %s\n", strerror(errno));
+    }
+    if(close(o->tar) < 0) {
+        fprintf(stderr, "Failed to close output: %s\n", strerror(errno));
+        ret = -1;
+    }
+
+    free(o);
+
+    return(ret);
+}
@@ -0,0 +1,75 @@
+#include <sys/types.h>
+
+#define TAR_BLOCK_SIZE (512)
+#define OUTPUT_NAME_MAX (100)
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+/* what direct writes need to be aligned to */
+#define OUTPUT_ALIGN (4096)
+
+#define OUTPUT_ASSET_NEW  (0)
+#define OUTPUT_ASSET_OPEN (1)
+#define OUTPUT_ASSET_DONE (2)
+
+/* All the sizes are known before anything is written, so an asset can be
+   written in any order and finishes itself once the last byte is in. */
+typedef struct {
+    char name[OUTPUT_NAME_MAX];
+    unsigned int size;
+    unsigned int written;
+    int state;
+
+    /* file being written, when writing one file per asset */
+    int fd;
+    /* start of the data in a seekable archive */
+    off_t base;
+
+    /* writes gathered but not yet written, starting at bufOffset */
+    unsigned char *buf;
+    unsigned int bufOffset;
+    unsigned int bufLen;
+    /* the file is still open with O_DIRECT */
+    int direct;
+
+    /* of the data as it's written, only complete once hashed == size */
+    Hash hash;
+    unsigned int hashed;
+} OutputAsset;
+
+typedef struct {
+    /* tar stream, -1 when writing one file per asset */
+    int tar;
+
+    /* a seekable archive has every member reserved up front, so members can be
+       written at the same time.  otherwise they go out one after the other. */
+    int seekable;
+    off_t pos;
+
+    /* open files with O_DIRECT */
+    int direct;
+
+    /* bare asset data one after the other, with no archive around it */
+    int raw;
+
+    /* nothing is written, assets are only hashed */
+    int discard;
+
+    /* files have been linked together, so they're replaced rather than
+       written over */
+    int links;
+} Output;
+
+Output *output_open_files(int direct);
+Output *output_open_tar(const char *filename);
+Output *output_open_stream(int fd);
+Output *output_open_discard();
+int output_positional(Output *o);
+int output_relinkable(Output *o);
+int output_asset_init(Output *o, OutputAsset *a, const char *name,
+                      unsigned int size);
+int output_asset_write(Output *o, OutputAsset *a, const void *data,
+                       unsigned int size, unsigned int offset);
+int output_asset_end(Output *o, OutputAsset *a);
+int output_link(Output *o, const char *name, const char *target);
+int output_close(Output *o);
+int write_all(int fd, const void *data, unsigned int size);
+int pwrite_all(int fd, const void *data, unsigned int size, off_t pos);
@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "hash.h"
+#include "output.h"
+#include "pipeline.h"
+#include "readahead.h"
+#include "trace.h"
+
+#define CACHE_LINE (64)
+
+/* Assets are written by three stages: a reader going through the ops in the
+   order given, the calling thread handing each piece to the writer for its
+   asset, and the writers.  Stages are joined by single producer, single
+   consumer rings, so nothing on the way takes a lock.  The threads are started
+   once and kept for every song, waiting on the rings in between. */
+
+typedef struct {
+    /* -1 ends the stream, -2 stops the thread */
+    int asset;
+    unsigned int offset;
+    unsigned int size;
+    const unsigned char *data;
+
+    /* pool buffer data points in to, or -1 */
+    int buffer;
+} PipelineMsg;
+
+typedef struct {
+    PipelineMsg slot[PIPELINE_RING_SIZE];
+
+    /* head is only written by the producer and tail by the consumer, kept on
+       separate lines so they don't bounce between the two. */
+    unsigned int head __attribute__((aligned(CACHE_LINE)));
+    unsigned int tail __attribute__((aligned(CACHE_LINE)));
+
+    /* set while a side is asleep on the other's index, so it only has to be
+       woken when it is */
+    unsigned int popWaiting __attribute__((aligned(CACHE_LINE)));
+    unsigned int pushWaiting;
+} Ring;
+
+typedef struct {
+    Pipeline *p;
+    int index;
+} PipelineWriter;
+
+struct Pipeline {
+    Ring read;
+    Ring write[PIPELINE_MAX_WRITERS];
+    /* buffers go back to the reader from each writer */
+    Ring free[PIPELINE_MAX_WRITERS];
+    /* songs to read go to the reader, and each writer says when it's done
+       with one */
+    Ring job;
+    Ring done[PIPELINE_MAX_WRITERS];
+
+    /* bumped for every buffer given back, for the reader to sleep on */
+    unsigned int freed __attribute__((aligned(CACHE_LINE)));
+    unsigned int freeWaiting;
+
+    Output *out;
+    OutputAsset *asset;
+    const PipelineOp *op;
+    unsigned int ops;
+    int fd;
+    int writers;
+
+    unsigned char *pool;
+    int failed;
+
+    /* hints for the reads, only when there's a file to read from */
+    Readahead ra;
+    int readahead;
+    int dropPages;
+
+    pthread_t reader;
+    pthread_t writer[PIPELINE_MAX_WRITERS];
+    PipelineWriter w[PIPELINE_MAX_WRITERS];
+};
+
+/* sleep as long as *word is still value */
+void futex_wait(unsigned int *word, unsigned int value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(unsigned int *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* a side going to sleep says so before it looks at the index one last time,
+   and a side moving its index looks for that after, so one of them always
+   sees the other. */
+void futex_sleep(unsigned int *waiting, unsigned int *word, unsigned int value) {
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(word, __ATOMIC_SEQ_CST) == value) {
+        futex_wait(word, value);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+void futex_moved(unsigned int *waiting, unsigned int *word) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        futex_wake(word);
+    }
+}
+
+void ring_init(Ring *r) {
+    r->head = 0;
+    r->tail = 0;
+    r->popWaiting = 0;
+    r->pushWaiting = 0;
+}
+
+int ring_try_push(Ring *r, const PipelineMsg *m) {
+    unsigned int head = r->head;
+
+    if(head - __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE) == PIPELINE_RING_SIZE) {
+        return(0);
+    }
+    r->slot[head % PIPELINE_RING_SIZE] = *m;
+    __atomic_store_n(&(r->head), head + 1, __ATOMIC_RELEASE);
+    futex_moved(&(r->popWaiting), &(r->head));
+
+    return(1);
+}
+
+int ring_try_pop(Ring *r, PipelineMsg *m) {
+    unsigned int tail = r->tail;
+
+    if(__atomic_load_n(&(r->head), __ATOMIC_ACQUIRE) == tail) {
+        return(0);
+    }
+    *m = r->slot[tail % PIPELINE_RING_SIZE];
+    __atomic_store_n(&(r->tail), tail + 1, __ATOMIC_RELEASE);
+    futex_moved(&(r->pushWaiting), &(r->tail));
+
+    return(1);
+}
+
+/* stages mostly wait on each other when one is falling behind for a moment,
+   so give the time to it for a bit, then sleep until there's something. */
+void ring_push(Ring *r, const PipelineMsg *m) {
+    unsigned int spins = 0;
+    unsigned int tail;
+
+    while(!ring_try_push(r, m)) {
+        if(spins++ < PIPELINE_SPINS) {
+            sched_yield();
+            continue;
+        }
+        tail = r->head - PIPELINE_RING_SIZE;
+        futex_sleep(&(r->pushWaiting), &(r->tail), tail);
+    }
+}
+
+void ring_pop(Ring *r, PipelineMsg *m) {
+    unsigned int spins = 0;
+
+    while(!ring_try_pop(r, m)) {
+        if(spins++ < PIPELINE_SPINS) {
+            sched_yield();
+            continue;
+        }
+        futex_sleep(&(r->popWaiting), &(r->head), r->tail);
+    }
+}
+
+int pipeline_failed(Pipeline *p) {
+    return(__atomic_load_n(&(p->failed), __ATOMIC_RELAXED));
+}
+
+void pipeline_fail(Pipeline *p) {
+    __atomic_store_n(&(p->failed), 1, __ATOMIC_RELAXED);
+}
+
+int pread_all(int fd, unsigned char *buf, unsigned int size, off_t pos) {
+    ssize_t ret;
+
+    while(size > 0) {
+        ret = pread(fd, buf, size, pos);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to read chunk data: %s\n", strerror(errno));
+            return(-1);
+        } else if(ret == 0) {
+            fprintf(stderr, "Chunk data runs past the end of the file.\n");
+            return(-1);
+        }
+        buf += ret;
+        size -= ret;
+        pos += ret;
+    }
+
+    return(0);
+}
+
+/* buffers come back from any of the writers, so the reader sleeps on a count
+   of them rather than on one ring */
+int get_buffer(Pipeline *p, int *freeList, int *frees) {
+    PipelineMsg m;
+    unsigned int spins = 0;
+    unsigned int freed;
+    int i;
+
+    while(*frees == 0) {
+        freed = __atomic_load_n(&(p->freed), __ATOMIC_ACQUIRE);
+        for(i = 0; i < p->writers; i++) {
+            while(ring_try_pop(&(p->free[i]), &m)) {
+                freeList[(*frees)++] = m.buffer;
+            }
+        }
+        if(*frees > 0) {
+            break;
+        }
+        if(spins++ < PIPELINE_SPINS) {
+            sched_yield();
+        } else {
+            futex_sleep(&(p->freeWaiting), &(p->freed), freed);
+        }
+    }
+
+    return(freeList[--(*frees)]);
+}
+
+void put_buffer(Pipeline *p, int index, const PipelineMsg *m) {
+    ring_push(&(p->free[index]), m);
+    __atomic_add_fetch(&(p->freed), 1, __ATOMIC_RELEASE);
+    futex_moved(&(p->freeWaiting), &(p->freed));
+}
+
+/* go through the ops of one song */
+void pipeline_read(Pipeline *p, int *freeList, int *frees) {
+    const PipelineOp *o;
+    PipelineMsg m;
+    unsigned int i;
+    unsigned int done;
+    unsigned char *buf;
+    unsigned long long start;
+
+    for(i = 0; i < p->ops && !pipeline_failed(p); i++) {
+        o = &(p->op[i]);
+        m.asset = o->asset;
+
+        if(o->data != NULL || o->size == 0) {
+            m.offset = o->offset;
+            m.size = o->size;
+            m.data = o->data;
+            m.buffer = -1;
+            ring_push(&(p->read), &m);
+            continue;
+        }
+
+        if(p->readahead) {
+            readahead_plan(&(p->ra), i);
+        }
+        for(done = 0; done < o->size; done += m.size) {
+            m.buffer = get_buffer(p, freeList, frees);
+            buf = &(p->pool[m.buffer * PIPELINE_BUFFER_SIZE]);
+
+            m.offset = o->offset + done;
+            m.size = o->size - done;
+            if(m.size > PIPELINE_BUFFER_SIZE) {
+                m.size = PIPELINE_BUFFER_SIZE;
+            }
+            start = trace_now();
+            if(pread_all(p->fd, buf, m.size, o->fileOffset + done) < 0) {
+                pipeline_fail(p);
+                break;
+            }
+            trace_span(start, "read", "%u bytes at %lld", m.size,
+                       (long long)(o->fileOffset + done));
+            if(p->readahead) {
+                readahead_done(&(p->ra), i, m.size);
+            }
+            m.data = buf;
+            ring_push(&(p->read), &m);
+        }
+    }
+
+    m.asset = -1;
+    ring_push(&(p->read), &m);
+}
+
+void *pipeline_reader(void *priv) {
+    Pipeline *p = priv;
+    PipelineMsg m;
+    int freeList[PIPELINE_BUFFERS];
+    int frees;
+
+    trace_thread("reader");
+    for(frees = 0; frees < PIPELINE_BUFFERS; frees++) {
+        freeList[frees] = frees;
+    }
+
+    for(;;) {
+        ring_pop(&(p->job), &m);
+        if(m.asset < -1) {
+            break;
+        }
+        pipeline_read(p, freeList, &frees);
+    }
+    trace_thread_done();
+
+    return(NULL);
+}
+
+void *pipeline_writer(void *priv) {
+    PipelineWriter *w = priv;
+    Pipeline *p = w->p;
+    PipelineMsg m;
+    char name[TRACE_ARG_MAX];
+    unsigned long long start;
+
+    if(Tracing) {
+        snprintf(name, sizeof(name), "writer %d", w->index);
+        trace_thread(name);
+    }
+    for(;;) {
+        ring_pop(&(p->write[w->index]), &m);
+        if(m.asset < -1) {
+            break;
+        } else if(m.asset < 0) {
+            ring_push(&(p->done[w->index]), &m);
+            continue;
+        }
+
+        /* keep taking pieces after a failure so nothing backs up */
+        start = trace_now();
+        if(!pipeline_failed(p) &&
+           output_asset_write(p->out, &(p->asset[m.asset]),
+                              m.data, m.size, m.offset) < 0) {
+            pipeline_fail(p);
+        }
+        trace_span(start, "write", "%s, %u bytes at %u",
+                   p->asset[m.asset].name, m.size, m.offset);
+
+        if(m.buffer >= 0) {
+            put_buffer(p, w->index, &m);
+        }
+    }
+    trace_thread_done();
+
+    return(NULL);
+}
+
+/* stop the reader and the first writers of p */
+void pipeline_stop(Pipeline *p, int reader, int writers) {
+    PipelineMsg m;
+    int i;
+
+    m.asset = -2;
+    if(reader) {
+        ring_push(&(p->job), &m);
+        pthread_join(p->reader, NULL);
+    }
+    for(i = 0; i < writers; i++) {
+        ring_push(&(p->write[i]), &m);
+    }
+    for(i = 0; i < writers; i++) {
+        pthread_join(p->writer[i], NULL);
+    }
+}
+
+/* start the threads and allocate the buffers used for every song after.
+   dropPages is for going through a whole SI once, when nothing read will be
+   wanted again. */
+Pipeline *pipeline_open(int writers, int dropPages) {
+    Pipeline *p;
+    int i;
+    int ret;
+
+    if(writers < 1) {
+        writers = 1;
+    } else if(writers > PIPELINE_MAX_WRITERS) {
+        writers = PIPELINE_MAX_WRITERS;
+    }
+
+    if(posix_memalign((void **)&p, CACHE_LINE, sizeof(Pipeline)) != 0) {
+        fprintf(stderr, "Failed to allocate memory for pipeline.\n");
+        return(NULL);
+    }
+    p->pool = malloc(PIPELINE_BUFFERS * PIPELINE_BUFFER_SIZE);
+    if(p->pool == NULL) {
+        fprintf(stderr, "Failed to allocate memory for pipeline buffers.\n");
+        goto error0;
+    }
+    p->ops = 0;
+    p->failed = 0;
+    p->readahead = 0;
+    p->dropPages = dropPages;
+    p->freed = 0;
+    p->freeWaiting = 0;
+
+    ring_init(&(p->read));
+    ring_init(&(p->job));
+    for(i = 0; i < writers; i++) {
+        ring_init(&(p->write[i]));
+        ring_init(&(p->free[i]));
+        ring_init(&(p->done[i]));
+    }
+
+    for(i = 0; i < writers; i++) {
+        p->w[i].p = p;
+        p->w[i].index = i;
+        ret = pthread_create(&(p->writer[i]), NULL, pipeline_writer, &(p->w[i]));
+        if(ret != 0) {
+            fprintf(stderr, "Failed to create writer thread: %s\n", strerror(ret));
+            break;
+        }
+    }
+    p->writers = i;
+    if(p->writers == 0) {
+        goto error1;
+    }
+
+    ret = pthread_create(&(p->reader), NULL, pipeline_reader, p);
+    if(ret != 0) {
+        fprintf(stderr, "Failed to create reader thread: %s\n", strerror(ret));
+        goto error2;
+    }
+
+    return(p);
+
+error2:
+    pipeline_stop(p, 0, p->writers);
+error1:
+    free(p->pool);
+error0:
+    free(p);
+    return(NULL);
+}
+
+/* Write out everything described by op, reading what isn't in memory from fd.
+   Each asset always goes to the same writer, so its pieces are written in the
+   order they appear in op.  Archive streams only get one writer. */
+int pipeline_run(Pipeline *p, Output *out, OutputAsset *asset,
+                 const PipelineOp *op, unsigned int ops, int fd) {
+    PipelineMsg m;
+    int writers;
+    int i;
+
+    writers = output_positional(out) ? p->writers : 1;
+
+    p->out = out;
+    p->asset = asset;
+    p->op = op;
+    p->ops = ops;
+    p->fd = fd;
+    p->failed = 0;
+    p->readahead = 0;
+    if(fd >= 0 && ops > 0) {
+        if(readahead_init(&(p->ra), fd, op, ops, p->dropPages) < 0) {
+            return(-1);
+        }
+        p->readahead = 1;
+    }
+
+    /* demux, pieces of an asset always go to the same writer */
+    m.asset = 0;
+    ring_push(&(p->job), &m);
+    for(;;) {
+        ring_pop(&(p->read), &m);
+        if(m.asset < 0) {
+            break;
+        }
+        ring_push(&(p->write[m.asset % writers]), &m);
+    }
+
+    /* everything's written once every writer has got to the end */
+    for(i = 0; i < p->writers; i++) {
+        ring_push(&(p->write[i]), &m);
+    }
+    for(i = 0; i < p->writers; i++) {
+        ring_pop(&(p->done[i]), &m);
+    }
+
+    if(p->readahead) {
+        readahead_free(&(p->ra));
+        p->readahead = 0;
+    }
+
+    return(pipeline_failed(p) ? -1 : 0);
+}
+
+/* returns what it was before, for a pass over something which is going to be
+   read again */
+int pipeline_drop_pages(Pipeline *p, int dropPages) {
+    int was = p->dropPages;
+
+    p->dropPages = dropPages;
+
+    return(was);
+}
+
+void pipeline_close(Pipeline *p) {
+    pipeline_stop(p, 1, p->writers);
+    free(p->pool);
+    free(p);
+}
@@ -0,0 +1,27 @@
+#define PIPELINE_RING_SIZE    (64)
+#define PIPELINE_BUFFERS      (16)
+#define PIPELINE_BUFFER_SIZE  (65536)
+#define PIPELINE_MAX_WRITERS  (16)
+/* times a stage looks again before sleeping until it's woken */
+#define PIPELINE_SPINS        (64)
+
+/* One piece of an asset.  Data already in memory is passed along as is,
+   everything else is read from the SI in to a pooled buffer. */
+typedef struct {
+    int asset;
+    unsigned int offset;
+    unsigned int size;
+
+    const unsigned char *data;
+    off_t fileOffset;
+} PipelineOp;
+
+/* threads and buffers assets are written through, kept for a whole run */
+typedef struct Pipeline Pipeline;
+
+int pread_all(int fd, unsigned char *buf, unsigned int size, off_t pos);
+Pipeline *pipeline_open(int writers, int dropPages);
+int pipeline_run(Pipeline *p, Output *out, OutputAsset *asset,
+                 const PipelineOp *op, unsigned int ops, int fd);
+int pipeline_drop_pages(Pipeline *p, int dropPages);
+void pipeline_close(Pipeline *p);
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+#include "hash.h"
+#include "output.h"
+#include "pipeline.h"
+#include "readahead.h"
+
+/* All the reads extraction does are known before it starts, so the kernel is
+   told about them a window ahead of the reader.  When going through a whole
+   SI, pages are also dropped once everything in them has been read so a big
+   SI doesn't push everything else out of the page cache. */
+
+typedef struct {
+    off_t start;
+    off_t end;
+    unsigned int op;
+} ReadaheadRange;
+
+int range_compare(const void *a, const void *b) {
+    const ReadaheadRange *r1 = a;
+    const ReadaheadRange *r2 = b;
+
+    if(r1->start < r2->start) {
+        return(-1);
+    } else if(r1->start > r2->start) {
+        return(1);
+    }
+    return(0);
+}
+
+int readahead_init(Readahead *ra, int fd, const PipelineOp *op,
+                   unsigned int ops, int drop) {
+    ReadaheadRange *range;
+    ReadaheadExtent *e = NULL;
+    unsigned int ranges = 0;
+    unsigned int i;
+
+    ra->fd = fd;
+    ra->op = op;
+    ra->ops = ops;
+    ra->drop = drop;
+    ra->extents = 0;
+    ra->ahead = 0;
+    ra->aheadBytes = 0;
+
+    ra->extent = malloc(sizeof(ReadaheadExtent) * ops);
+    ra->opExtent = malloc(sizeof(int) * ops);
+    range = malloc(sizeof(ReadaheadRange) * ops);
+    if(ra->extent == NULL || ra->opExtent == NULL || range == NULL) {
+        fprintf(stderr, "Failed to allocate memory for readahead plan.\n");
+        goto error0;
+    }
+
+    for(i = 0; i < ops; i++) {
+        ra->opExtent[i] = -1;
+        if(op[i].data != NULL || op[i].size == 0) {
+            continue;
+        }
+        range[ranges].start = op[i].fileOffset;
+        range[ranges].end = op[i].fileOffset + op[i].size;
+        range[ranges].op = i;
+        ranges++;
+    }
+
+    qsort(range, ranges, sizeof(ReadaheadRange), range_compare);
+
+    for(i = 0; i < ranges; i++) {
+        if(e == NULL || range[i].start > e->end + READAHEAD_MERGE_GAP) {
+            e = &(ra->extent[ra->extents]);
+            ra->extents++;
+            e->start = range[i].start;
+            e->end = range[i].end;
+            e->remaining = 0;
+            e->advised = 0;
+        } else if(range[i].end > e->end) {
+            e->end = range[i].end;
+        }
+        e->remaining += range[i].end - range[i].start;
+        ra->opExtent[range[i].op] = ra->extents - 1;
+    }
+
+    free(range);
+
+    return(0);
+
+error0:
+    free(range);
+    readahead_free(ra);
+    return(-1);
+}
+
+/* called before op index is read, hints everything up to a window past it */
+void readahead_plan(Readahead *ra, unsigned int index) {
+    ReadaheadExtent *e;
+
+    if(ra->ahead < index) {
+        ra->ahead = index;
+        ra->aheadBytes = 0;
+    }
+
+    while(ra->ahead < ra->ops && ra->aheadBytes < READAHEAD_WINDOW) {
+        if(ra->opExtent[ra->ahead] >= 0) {
+            e = &(ra->extent[ra->opExtent[ra->ahead]]);
+            if(!e->advised) {
+                posix_fadvise(ra->fd, e->start, e->end - e->start,
+                              POSIX_FADV_WILLNEED);
+                e->advised = 1;
+            }
+            ra->aheadBytes += ra->op[ra->ahead].size;
+        }
+        ra->ahead++;
+    }
+}
+
+/* called once size bytes of op index have been read */
+void readahead_done(Readahead *ra, unsigned int index, unsigned int size) {
+    ReadaheadExtent *e;
+
+    if(ra->opExtent[index] < 0) {
+        return;
+    }
+    e = &(ra->extent[ra->opExtent[index]]);
+
+    ra->aheadBytes -= size;
+    e->remaining -= size;
+    if(e->remaining == 0 && ra->drop) {
+        posix_fadvise(ra->fd, e->start, e->end - e->start, POSIX_FADV_DONTNEED);
+    }
+}
+
+void readahead_free(Readahead *ra) {
+    free(ra->extent);
+    free(ra->opExtent);
+    ra->extent = NULL;
+    ra->opExtent = NULL;
+}
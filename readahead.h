@@ -0,0 +1,35 @@
+#define READAHEAD_WINDOW    (8 * 1024 * 1024)
+#define READAHEAD_MERGE_GAP (4096)
+
+/* a run of the SI which is read, chunk bodies close together are merged in
+   to one so hints aren't given for every little piece. */
+typedef struct {
+    off_t start;
+    off_t end;
+    /* bytes still to be read before it can be dropped */
+    off_t remaining;
+    int advised;
+} ReadaheadExtent;
+
+typedef struct {
+    int fd;
+    const PipelineOp *op;
+    unsigned int ops;
+    /* pages are dropped once read, they won't be wanted again */
+    int drop;
+
+    ReadaheadExtent *extent;
+    unsigned int extents;
+    /* for each op, -1 for those not read from the file */
+    int *opExtent;
+
+    /* ops before this one have been hinted */
+    unsigned int ahead;
+    off_t aheadBytes;
+} Readahead;
+
+int readahead_init(Readahead *ra, int fd, const PipelineOp *op,
+                   unsigned int ops, int drop);
+void readahead_plan(Readahead *ra, unsigned int index);
+void readahead_done(Readahead *ra, unsigned int index, unsigned int size);
+void readahead_free(Readahead *ra);
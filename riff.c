@@ -1,133 +1,291 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "riff.h"
+#include "trace.h"
 
 /* minimum value necessary to get a list of all SIs */
 #define BRUTE_ISENTRY_TRIES     (16)
-#define CHUNK_MINIMUM_SIZE      (12)
 
-const short int OMNI_TRACK_TYPE_MUXED[] = {6, 7, 9};
+/* how many levels to scan serially looking for subtrees to hand out to
+   threads, the songs are 2 levels down */
+#define PARALLEL_EXPAND_DEPTH   (2)
 
 const char RIFFMagic[4] = {'R', 'I', 'F', 'F'};
-const char LISTFourCC[4] = {'L', 'I', 'S', 'T'};
-const char MxObFourCC[4] = {'M', 'x', 'O', 'b'};
-const char MxStFourCC[4] = {'M', 'x', 'S', 't'};
-const char MxChFourCC[4] = {'M', 'x', 'C', 'h'};
-const char Nodes[][4] = 
-    {
-        {'R', 'I', 'F', 'F'}, /* root entry */
-        {'L', 'I', 'S', 'T'},
-        {'M', 'x', 'S', 't'}
-    };
-
-const char Leaves[][4] =
-    {
-        {'M', 'x', 'H', 'd'},
-        {'M', 'x', 'O', 'f'},
-        {'p', 'a', 'd', ' '},
-        {'M', 'x', 'C', 'h'},
-        {'M', 'x', 'O', 'b'}
-    };
-
-int isRIFF(char fourCC[4]) {
-    if(!memcmp(fourCC, RIFFMagic, sizeof(RIFFMagic))) {
-        return(1);
+
+#define RIFF_CLASS_NODE (1)
+#define RIFF_CLASS_LEAF (2)
+
+/* a switch on constants, which the compiler can turn in to a jump table or a
+   few compares, rather than searching tables of fourCCs */
+int riff_class(unsigned int fourCC) {
+    switch(fourCC) {
+        case RIFF_FOURCC: /* root entry */
+        case LIST_FOURCC:
+        case MxSt_FOURCC:
+            return(RIFF_CLASS_NODE);
+        case MxHd_FOURCC:
+        case MxOf_FOURCC:
+        case pad_FOURCC:
+        case MxCh_FOURCC:
+        case MxOb_FOURCC:
+            return(RIFF_CLASS_LEAF);
+        default:
+            return(0);
     }
+}
 
-    return(0);
+int isRIFF(unsigned int fourCC) {
+    return(fourCC == RIFF_FOURCC);
 }
 
-int isLIST(char fourCC[4]) {
-    if(!memcmp(fourCC, LISTFourCC, sizeof(LISTFourCC))) {
-        return(1);
-    }
+int isLIST(unsigned int fourCC) {
+    return(fourCC == LIST_FOURCC);
+}
 
-    return(0);
+int isNode(unsigned int fourCC) {
+    return(riff_class(fourCC) == RIFF_CLASS_NODE);
 }
 
-int isNode(char fourCC[4]) {
-    unsigned int i;
+int isLeaf(unsigned int fourCC) {
+    return(riff_class(fourCC) == RIFF_CLASS_LEAF);
+}
+
+int isEntry(unsigned int fourCC) {
+    return(riff_class(fourCC) != 0);
+}
 
-    for(i = 0; i < sizeof(Nodes) / sizeof(Nodes[0]); i++) {
-        if(!memcmp(fourCC, Nodes[i], sizeof(Nodes[i]))) {
+int isMuxed(short int type) {
+    switch(type) {
+        case 6:
+        case 7:
+        case 9:
             return(1);
-        }
+        default:
+            return(0);
     }
-
-    return(0);
 }
 
-int isLeaf(char fourCC[4]) {
-    unsigned int i;
+RIFFFile *riff_init() {
+    RIFFFile *r;
 
-    for(i = 0; i < sizeof(Leaves) / sizeof(Leaves[0]); i++) {
-        if(!memcmp(fourCC, Leaves[i], sizeof(Leaves[i]))) {
-            return(1);
-        }
+    r = malloc(sizeof(RIFFFile));
+    if(r == NULL) {
+        fprintf(stderr, "Failed to allocate memory for RIFFFile.\n");
+        return(NULL);
+    }
+    r->f = NULL;
+    r->type = NULL;
+    r->node = NULL;
+    r->entry = NULL;
+    r->entries = NULL;
+    r->nodeCount = 0;
+    r->nodeMemCount = 0;
+    r->start = NULL;
+    r->size = NULL;
+    r->parent = NULL;
+    r->entryCount = 0;
+    r->entryMemCount = 0;
+    r->fallbacks = 0;
+
+    r->typeSlots = RIFF_INITIAL_TYPE_SLOTS;
+    r->typeMemCount = RIFF_INITIAL_TYPE_SLOTS / 2;
+    r->types = malloc(sizeof(RIFFType) * r->typeMemCount);
+    r->typeSlot = calloc(r->typeSlots, sizeof(unsigned int));
+    if(r->types == NULL || r->typeSlot == NULL) {
+        fprintf(stderr, "Failed to allocate memory for entry types.\n");
+        free(r->types);
+        free(r->typeSlot);
+        free(r);
+        return(NULL);
     }
+    /* entries start out as this until they're given a type, so one which
+       never is can't be taken for a node */
+    r->types[RIFF_NO_TYPE].fourCC = 0;
+    r->types[RIFF_NO_TYPE].fourCC2 = 0;
+    r->types[RIFF_NO_TYPE].key = 0;
+    r->types[RIFF_NO_TYPE].isNode = 0;
+    r->types[RIFF_NO_TYPE].isLIST = 0;
+    r->typeCount = 1;
 
-    return(0);
+    return(r);
 }
 
-int isEntry(char fourCC[4]) {
-    if(isNode(fourCC) || isLeaf(fourCC) ||
-       !memcmp(fourCC, MxObFourCC, sizeof(MxObFourCC))) {
-        return(1);
+#define GROW_ARRAY(ARRAY, COUNT) \
+    do { \
+        void *a = realloc((ARRAY), sizeof(*(ARRAY)) * (COUNT)); \
+        if(a == NULL) { \
+            fprintf(stderr, "Failed to allocate memory to grow entry table.\n"); \
+            return(-1); \
+        } \
+        (ARRAY) = a; \
+    } while(0)
+
+/* add an entry with no type yet, returns its index */
+int riff_grow(RIFFFile *r, int parent, unsigned int start) {
+    unsigned int count;
+
+    if(r->entryCount == r->entryMemCount) {
+        count = r->entryMemCount == 0 ? 64 : r->entryMemCount * 2;
+        GROW_ARRAY(r->type, count);
+        GROW_ARRAY(r->node, count);
+        GROW_ARRAY(r->start, count);
+        GROW_ARRAY(r->size, count);
+        GROW_ARRAY(r->parent, count);
+        r->entryMemCount = count;
     }
 
-    return(0);
+    r->type[r->entryCount] = RIFF_NO_TYPE;
+    r->node[r->entryCount] = -1;
+    r->start[r->entryCount] = start;
+    r->size[r->entryCount] = 0;
+    r->parent[r->entryCount] = parent;
+    r->entryCount++;
+
+    return(r->entryCount - 1);
 }
 
-int isMuxed(short int type) {
+/* where the type for a fourCC pair is, or the empty slot it would go in */
+unsigned int *riff_type_slot(unsigned int *slot, unsigned int slots,
+                             const RIFFType *types,
+                             unsigned int fourCC, unsigned int fourCC2) {
+    unsigned int i;
+    const RIFFType *t;
+
+    i = fourCC2 * 0x9E3779B1u + fourCC;
+    i ^= i >> 15;
+    i *= 0x85EBCA77u;
+    i ^= i >> 13;
+    for(i &= slots - 1;; i = (i + 1) & (slots - 1)) {
+        if(slot[i] == 0) {
+            return(&(slot[i]));
+        }
+        t = &(types[slot[i] - 1]);
+        if(t->fourCC == fourCC && t->fourCC2 == fourCC2) {
+            return(&(slot[i]));
+        }
+    }
+}
+
+/* make room for one more type, keeping the table at most half full */
+int riff_grow_types(RIFFFile *r) {
+    unsigned int *slot;
     unsigned int i;
+    const RIFFType *t;
 
-    for(i = 0; i < sizeof(OMNI_TRACK_TYPE_MUXED) / sizeof(OMNI_TRACK_TYPE_MUXED[0]); i++) {
-        if(type == OMNI_TRACK_TYPE_MUXED[i]) {
-            return(1);
+    if(r->typeCount == r->typeMemCount) {
+        GROW_ARRAY(r->types, r->typeMemCount * 2);
+        r->typeMemCount *= 2;
+    }
+    if(r->typeCount * 2 < r->typeSlots) {
+        return(0);
+    }
+
+    slot = calloc(r->typeSlots * 2, sizeof(unsigned int));
+    if(slot == NULL) {
+        fprintf(stderr, "Failed to allocate memory to grow entry types.\n");
+        return(-1);
+    }
+    for(i = 0; i < r->typeSlots; i++) {
+        if(r->typeSlot[i] != 0) {
+            t = &(r->types[r->typeSlot[i] - 1]);
+            *riff_type_slot(slot, r->typeSlots * 2, r->types,
+                            t->fourCC, t->fourCC2) = r->typeSlot[i];
         }
     }
+    free(r->typeSlot);
+    r->typeSlot = slot;
+    r->typeSlots *= 2;
 
     return(0);
 }
 
-RIFFFile *riff_init() {
-    RIFFFile *r;
+/* find or add the type for a fourCC pair, and make the entry a node if the
+   type is one */
+int riff_set_type(RIFFFile *r, int index, unsigned int fourCC, unsigned int fourCC2) {
+    unsigned int *slot;
+    unsigned int i;
+    unsigned int count;
+    RIFFType *t;
 
-    r = malloc(sizeof(RIFFFile));
-    if(r == NULL) {
-        fprintf(stderr, "Failed to allocate memory for RIFFFile.\n");
-        return(NULL);
+    slot = riff_type_slot(r->typeSlot, r->typeSlots, r->types, fourCC, fourCC2);
+    if(*slot == 0) {
+        if(riff_grow_types(r) < 0) {
+            return(-1);
+        }
+        slot = riff_type_slot(r->typeSlot, r->typeSlots, r->types,
+                              fourCC, fourCC2);
+        t = &(r->types[r->typeCount]);
+        t->fourCC = fourCC;
+        t->fourCC2 = fourCC2;
+        t->isNode = isNode(fourCC);
+        t->isLIST = isLIST(fourCC);
+        t->key = t->isLIST ? fourCC2 : fourCC;
+        r->typeCount++;
+        *slot = r->typeCount;
     }
-    r->f = NULL;
-    r->root = NULL;
-    r->entryMemCount = 0;
-    
-    return(r);
+    i = *slot - 1;
+    r->type[index] = i;
+
+    if(r->types[i].isNode && r->node[index] == -1) {
+        if(r->nodeCount == r->nodeMemCount) {
+            count = r->nodeMemCount == 0 ? 16 : r->nodeMemCount * 2;
+            GROW_ARRAY(r->entry, count);
+            GROW_ARRAY(r->entries, count);
+            r->nodeMemCount = count;
+        }
+        r->entry[r->nodeCount] = -1;
+        r->entries[r->nodeCount] = 0;
+        r->node[index] = r->nodeCount;
+        r->nodeCount++;
+    }
+
+    return(0);
 }
 
-int riff_grow(RIFFFile *r) {
-    RIFFEntry *e;
+/* add a child to a node, which must be the last node added to */
+int riff_add_child(RIFFFile *r, int index, unsigned int start) {
+    int cur;
 
-    e = realloc(r->root, sizeof(RIFFEntry) * (r->entryMemCount + 1));
-    if(e == NULL) {
-        fprintf(stderr, "Failed to allocate memory to grow entry table.\n");
+    cur = riff_grow(r, index, start);
+    if(cur < 0) {
         return(-1);
     }
+    if(r->entry[r->node[index]] == -1) {
+        r->entry[r->node[index]] = cur;
+    }
+    r->entries[r->node[index]]++;
 
-    r->root = e;
-    r->entryMemCount++;
+    return(cur);
+}
 
-    return(r->entryMemCount-1);
+/* take back the child just added to a node, when it couldn't be filled in */
+void riff_drop_child(RIFFFile *r, int index) {
+    r->entries[r->node[index]]--;
+    if(r->entries[r->node[index]] == 0) {
+        r->entry[r->node[index]] = -1;
+    }
+    r->entryCount--;
+}
+
+int riff_entries(RIFFFile *r, int index) {
+    if(r->node[index] == -1) {
+        return(0);
+    }
+
+    return(r->entries[r->node[index]]);
 }
 
 off_t riff_entry_offset(RIFFFile *r, int index) {
     off_t pos = 0;
 
     while(index != -1) {
-        pos += r->root[index].start;
-        index = r->root[index].parent;
+        pos += r->start[index];
+        index = r->parent[index];
     }
 
     return(pos);
@@ -141,206 +299,578 @@ int riff_entry_seekto(RIFFFile *r, int index) {
     return(0);
 }
 
+void riff_reader_init(RIFFReader *rd, int fd) {
+    rd->fd = fd;
+    rd->stream = 0;
+    rd->fallbacks = 0;
+    rd->pos = 0;
+    rd->bufStart = 0;
+    rd->bufLen = 0;
+}
+
+/* for pipes, only reads forward but keeps the last RIFF_READER_KEEP bytes
+   around to allow seeking back a little */
+void riff_reader_init_stream(RIFFReader *rd, int fd) {
+    riff_reader_init(rd, fd);
+    rd->stream = 1;
+}
+
+/* read the next block of a stream, returns the amount read */
+ssize_t stream_fill(RIFFReader *rd) {
+    unsigned int keep;
+    ssize_t ret;
+
+    keep = rd->bufLen < RIFF_READER_KEEP ? rd->bufLen : RIFF_READER_KEEP;
+    memmove(rd->buf, &(rd->buf[rd->bufLen - keep]), keep);
+    rd->bufStart += rd->bufLen - keep;
+    rd->bufLen = keep;
+
+    do {
+        ret = read(rd->fd, &(rd->buf[keep]), sizeof(rd->buf) - keep);
+    } while(ret < 0 && errno == EINTR);
+    if(ret < 0) {
+        fprintf(stderr, "Failed to read: %s\n", strerror(errno));
+        return(-1);
+    }
+    rd->bufLen += ret;
+
+    return(ret);
+}
+
+/* positional reads only, so readers on different threads can share a file */
+unsigned int riff_reader_read(RIFFReader *rd, void *dst, unsigned int size) {
+    unsigned char *d = dst;
+    unsigned int done = 0;
+    unsigned int count;
+    ssize_t ret;
+
+    while(done < size) {
+        if(rd->stream) {
+            if(rd->pos < rd->bufStart) {
+                fprintf(stderr, "Can't seek back %ld bytes in a stream.\n",
+                                (long)(rd->bufStart + rd->bufLen - rd->pos));
+                break;
+            }
+            if(rd->pos >= rd->bufStart + rd->bufLen) {
+                if(stream_fill(rd) <= 0) {
+                    break;
+                }
+                continue;
+            }
+        } else if(rd->pos < rd->bufStart || rd->pos >= rd->bufStart + rd->bufLen) {
+            /* big reads don't need to go through the buffer */
+            if(size - done >= sizeof(rd->buf)) {
+                ret = pread(rd->fd, &(d[done]), size - done, rd->pos);
+                if(ret <= 0) {
+                    break;
+                }
+                rd->pos += ret;
+                done += ret;
+                continue;
+            }
+
+            /* after skipping something big, odds are only a header is
+               wanted, so don't pull in a whole buffer for it */
+            count = sizeof(rd->buf);
+            if(rd->bufLen > 0 &&
+               (rd->pos < rd->bufStart || rd->pos > rd->bufStart + 2 * RIFF_READER_BUFFER)) {
+                count = RIFF_READER_SMALL_READ;
+            }
+            ret = pread(rd->fd, rd->buf, count, rd->pos);
+            if(ret <= 0) {
+                break;
+            }
+            rd->bufStart = rd->pos;
+            rd->bufLen = ret;
+        }
+
+        count = rd->bufStart + rd->bufLen - rd->pos;
+        if(count > size - done) {
+            count = size - done;
+        }
+        memcpy(&(d[done]), &(rd->buf[rd->pos - rd->bufStart]), count);
+        rd->pos += count;
+        done += count;
+    }
+
+    return(done);
+}
+
+int riff_reader_getc(RIFFReader *rd) {
+    unsigned char c;
+
+    if(rd->pos >= rd->bufStart && rd->pos < rd->bufStart + rd->bufLen) {
+        c = rd->buf[rd->pos - rd->bufStart];
+        rd->pos++;
+        return(c);
+    }
+
+    if(riff_reader_read(rd, &c, 1) < 1) {
+        return(-1);
+    }
+
+    return(c);
+}
+
+void riff_reader_seek(RIFFReader *rd, off_t offset, int whence) {
+    if(whence == SEEK_SET) {
+        rd->pos = offset;
+    } else {
+        rd->pos += offset;
+    }
+}
+
 /* probably some alignment rules i'm not familiar with, just brute force it */
-int brute_isEntry(FILE *f, char *fourCC, off_t *pos, int tries) {
+int brute_isEntry(RIFFReader *rd, unsigned int *fourCC, off_t *pos, int tries) {
+    int c;
+
+    if(riff_reader_read(rd, fourCC, 4) < 4) {
+        fprintf(stderr, "Failed to read entry fourCC.\n");
+        return(-1);
+    }
+
+    /* slide along a byte at a time rather than seeking back */
     for(; tries > 0; tries--) {
-        if(fread(fourCC, 1, 4, f) < 4) {
-            fprintf(stderr, "Failed to read entry fourCC.\n");
-            return(-1);
-        }
         (*pos)++;
 
-        if(isEntry(fourCC)) {
+        if(isEntry(*fourCC)) {
             (*pos) += 3;
             return(1);
         }
 
-        if(fseeko(f, -3, SEEK_CUR) < 0) {
-            fprintf(stderr, "Failed to seek back to entry.\n");
-            return(-1);
+        if(tries > 1) {
+            c = riff_reader_getc(rd);
+            if(c < 0) {
+                fprintf(stderr, "Failed to read entry fourCC.\n");
+                return(-1);
+            }
+            *fourCC = (*fourCC >> 8) | ((unsigned int)c << 24);
         }
     }
 
     return(0);
 }
 
-int riff_populate(RIFFFile *r, int index, int depth) {
-    char fourCC[4];
-    off_t pos = 0;
-    int cur;
-    int i;
-    int ret;
+/* Find the next entry in a node and read its header.  The reader is left at
+   the start of the entry's data, except for forged MxObs, which are read
+   through to find their size and are left at their end.  pos is updated to
+   match. */
+int riff_next_entry(RIFFReader *rd, off_t nodeOffset, unsigned int nodeSize,
+                    off_t *pos, RIFFHeader *h) {
+    int ret = 0;
+    off_t aligned;
     unsigned int MxObSize;
     unsigned short int unkNameSize;
     short int MxObType = 0;
 
-    if(!isNode(r->root[index].fourCC)) {
-        return(0);
+    /* entries are word aligned, so in a well formed file the next one is
+       right here, after a pad byte if the last one had an odd size.  only
+       scan for it if it isn't. */
+    aligned = *pos + ((nodeOffset + *pos) & 1);
+    riff_reader_seek(rd, nodeOffset + aligned, SEEK_SET);
+    if(riff_reader_read(rd, &(h->fourCC), 4) == 4 && isEntry(h->fourCC)) {
+        *pos = aligned + 4;
+        ret = 1;
+    } else {
+        rd->fallbacks++;
+        riff_reader_seek(rd, nodeOffset + *pos, SEEK_SET);
+        ret = brute_isEntry(rd, &(h->fourCC), pos, BRUTE_ISENTRY_TRIES);
+    }
+    if(ret == 0) {
+        fprintf(stderr, "Unknown fourCC %08X near %ld\n",
+                h->fourCC, nodeOffset + *pos - BRUTE_ISENTRY_TRIES);
+        return(-1);
+    } else if(ret < 0) { /* error reading fourCC */
+        return(-1);
     }
 
-    if(riff_entry_seekto(r, index) < 0) {
-        fprintf(stderr, "Failed to seek to entry.\n");
+    /* bunch of annoying stuff to forge a muxed MxOb */
+    if(riff_reader_read(rd, &MxObSize, sizeof(int)) < sizeof(int)) {
+        fprintf(stderr, "Failed to read entry size.\n");
+        return(-1);
+    }
+    if(riff_reader_read(rd, &MxObType, sizeof(short int)) < sizeof(short int)) {
+        fprintf(stderr, "Failed to read MxOb type.\n");
         return(-1);
     }
 
-    while(pos < r->root[index].size - CHUNK_MINIMUM_SIZE) {
-        ret = brute_isEntry(r->f, fourCC, &pos, BRUTE_ISENTRY_TRIES);
-        if(ret == 0) {
-            fprintf(stderr, "Unknown fourCC %08X near %ld\n",
-                    *((unsigned int *)fourCC),
-                    riff_entry_offset(r, index) + pos - BRUTE_ISENTRY_TRIES);
-            return(-1);
-        } else if(ret > 0) {
-            /* bunch of annoying stuff to forge a muxed MxOb */
-            if(fread(&MxObSize, 1, sizeof(int), r->f) < sizeof(int)) {
-                fprintf(stderr, "Failed to read entry size.\n");
-                return(-1);
+    h->fourCC2 = 0;
+    if(h->fourCC == MxOb_FOURCC && isMuxed(MxObType)) {
+        /* get an MxOb */
+        h->forged = 1;
+        h->start = *pos + 4;
+
+        /* If there's a string directly after the value, keep reading. */
+        *pos += 6;
+        while(*pos < nodeSize) {
+            (*pos)++;
+            if(riff_reader_getc(rd) == 0) {
+                break;
             }
-            if(fread(&MxObType, 1, sizeof(short int), r->f) < sizeof(short int)) {
-                fprintf(stderr, "Failed to read MxOb type.\n");
-                return(-1);
+        }
+        /* find the start of the name */
+        while(*pos < nodeSize) {
+            (*pos)++;
+            if(riff_reader_getc(rd) != 0) {
+                break;
             }
-            if(!memcmp(fourCC, MxObFourCC, sizeof(MxObFourCC)) &&
-               isMuxed(MxObType)) {
-                /* get an MxOb */
-                cur = riff_grow(r);
-                if(cur == -1) {
-                    return(-1);
-                }
-                if(r->root[index].entry == -1) {
-                    r->root[index].entry = cur;
-                }
+        }
+        /* keep consuming the name too */
+        while(*pos < nodeSize) {
+            (*pos)++;
+            if(riff_reader_getc(rd) == 0) {
+                break;
+            }
+        }
 
-                memcpy(&(r->root[cur].fourCC), MxObFourCC, sizeof(r->root[cur].fourCC));
-                r->root[cur].entries = 0;
-                r->root[cur].entry = -1;
-                r->root[cur].parent = index;
-                r->root[cur].start = pos + 4;
-
-                /* If there's a string directly after the value, keep reading. */
-                pos += 6;
-                while(pos < r->root[index].size) {
-                    pos++;
-                    if(fgetc(r->f) == 0) {
-                        break;
-                    }
-                }
-                /* find the start of the name */
-                while(pos < r->root[index].size) {
-                    pos++;
-                    if(fgetc(r->f) != 0) {
-                        break;
-                    }
-                }
-                /* keep consuming the name too */
-                while(pos < r->root[index].size) {
-                    pos++;
-                    if(fgetc(r->f) == 0) {
-                        break;
-                    }
-                }
+        /* seek past fixed-sized structure */
+        riff_reader_seek(rd, 92, SEEK_CUR);
+        *pos += 92;
 
-                /* seek past fixed-sized structure */
-                if(fseeko(r->f, 92, SEEK_CUR) < 0) {
-                    fprintf(stderr, "Failed to seek forward.\n");
-                    return(-1);
-                }
-                pos += 92;
+        if(riff_reader_read(rd, &unkNameSize, sizeof(short int)) < sizeof(short int)) {
+            fprintf(stderr, "Failed to read unknown name size.\n");
+            return(-1);
+        }
+        *pos += 2;
+        /* seek past string */
+        riff_reader_seek(rd, unkNameSize, SEEK_CUR);
+        *pos += unkNameSize;
 
-                if(fread(&unkNameSize, 1, sizeof(short int), r->f) < sizeof(short int)) {
-                    fprintf(stderr, "Failed to read unknown name size.\n");
-                    return(-1);
-                }
-                pos += 2;
-                /* seek past string */
-                if(fseeko(r->f, unkNameSize, SEEK_CUR) < 0) {
-                    fprintf(stderr, "Failed to seek forward.\n");
-                    return(-1);
-                }
-                pos += unkNameSize;
+        h->size = *pos - h->start;
 
-                r->root[cur].size = pos - r->root[cur].start;
-                r->root[index].entries++;
-            } else {
-                if(fseeko(r->f, -6, SEEK_CUR) < 0) {
-                    fprintf(stderr, "Failed to seek back to entry.\n");
-                    return(-1);
-                }
+        return(0);
+    }
 
-                cur = riff_grow(r);
-                if(cur == -1) {
-                    return(-1);
-                }
-                if(r->root[index].entry == -1) {
-                    r->root[index].entry = cur;
-                }
+    riff_reader_seek(rd, -2, SEEK_CUR);
+    h->forged = 0;
+    h->size = MxObSize;
+    *pos += 4;
+    if(isLIST(h->fourCC)) {
+        if(riff_reader_read(rd, &(h->fourCC2), sizeof(h->fourCC2)) < sizeof(h->fourCC2)) {
+            fprintf(stderr, "Failed to read entry second fourCC.\n");
+            return(-1);
+        }
+        *pos += 4;
+        h->size -= 4;
+
+        /* MxCh LISTs have a count of items in them */
+        if(h->fourCC2 == MxCh_FOURCC) {
+            riff_reader_seek(rd, 4, SEEK_CUR);
+            *pos += 4;
+            h->size -= 4;
+        }
+    }
+    h->start = *pos;
 
-                memcpy(&(r->root[cur].fourCC), fourCC, sizeof(r->root[cur].fourCC));
-                r->root[cur].entries = 0;
-                r->root[cur].entry = -1;
-                r->root[cur].parent = index;
+    return(0);
+}
 
-                if(fread(&(r->root[cur].size), 1, sizeof(int), r->f) < sizeof(int)) {
-                    fprintf(stderr, "Failed to read entry size.\n");
-                    return(-1);
-                }
-                pos += 4;
-                if(isLIST(fourCC)) {
-                    if(fread(r->root[cur].fourCC2, 1,
-                       sizeof(r->root[cur].fourCC2), r->f) < sizeof(r->root[cur].fourCC2)) {
-                        fprintf(stderr, "Failed to read entry second fourCC.\n");
-                        return(-1);
-                    }
-                    pos += 4;
-                    r->root[cur].size -= 4;
-
-                    /* MxCh LISTs have a count of items in them */
-                    if(!memcmp(r->root[cur].fourCC2, MxChFourCC, sizeof(MxChFourCC))) {
-                        if(fseeko(r->f, 4, SEEK_CUR) < 0) {
-                            fprintf(stderr, "Failed to seek past count.\n");
-                            return(-1);
-                        }
-                        pos += 4;
-                        r->root[cur].size -= 4;
-                    }
-                }
+/* add the immediate children of a node */
+int riff_scan(RIFFFile *r, RIFFReader *rd, int index) {
+    RIFFHeader h;
+    off_t offset;
+    unsigned int size;
+    off_t pos = 0;
+    int cur;
 
-                r->root[cur].start = pos;
+    if(!RIFF_TYPE(r, index)->isNode) {
+        return(0);
+    }
 
-                if(fseeko(r->f, r->root[cur].size, SEEK_CUR) < 0) {
-                    fprintf(stderr, "Failed to seek to next entry.\n");
-                    return(-1);
-                }
-                pos += r->root[cur].size;
+    offset = riff_entry_offset(r, index);
+    riff_reader_seek(rd, offset, SEEK_SET);
 
-                r->root[index].entries++;
-            }
-        } else { /* error reading fourCC */
+    size = r->size[index];
+    while(pos < size - CHUNK_MINIMUM_SIZE) {
+        if(riff_next_entry(rd, offset, size, &pos, &h) < 0) {
+            return(-1);
+        }
+
+        cur = riff_add_child(r, index, h.start);
+        if(cur == -1) {
+            return(-1);
+        }
+        if(riff_set_type(r, cur, h.fourCC, h.fourCC2) < 0) {
+            riff_drop_child(r, index);
+            return(-1);
+        }
+        r->size[cur] = h.size;
+
+        if(!h.forged) {
+            riff_reader_seek(rd, h.size, SEEK_CUR);
+            pos += h.size;
+        }
+    }
+
+    return(riff_entries(r, index));
+}
+
+int riff_populate(RIFFFile *r, RIFFReader *rd, int index) {
+    unsigned long long start = trace_now();
+    unsigned int key = RIFF_TYPE(r, index)->key;
+    int entries;
+    int i;
+
+    entries = riff_scan(r, rd, index);
+    if(entries < 0) {
+        return(-1);
+    }
+
+    /* children may add more nodes, so look these up each time */
+    for(i = 0; i < entries; i++) {
+        if(riff_populate(r, rd, r->entry[r->node[index]] + i) < 0) {
             return(-1);
         }
     }
 
-    for(i = 0; i < r->root[index].entries; i++) {
-        if(riff_populate(r, r->root[index].entry + i, depth + 1) < 0) {
+    /* finding the offset walks up the tree, so only when it's used */
+    if(start != 0 && RIFF_TYPE(r, index)->isNode) {
+        trace_span(start, "riff_populate", "%c%c%c%c at %lld",
+                   FOURCC_CHAR(key, 0), FOURCC_CHAR(key, 1),
+                   FOURCC_CHAR(key, 2), FOURCC_CHAR(key, 3),
+                   (long long)riff_entry_offset(r, index));
+    }
+    return(entries);
+}
+
+typedef struct {
+    RIFFFile *r;
+
+    /* subtree roots to populate */
+    int *job;
+    RIFFFile **result;
+    unsigned int jobs;
+
+    pthread_mutex_t lock;
+    unsigned int next;
+    int failed;
+} PopulateJobs;
+
+void *populate_worker(void *priv) {
+    PopulateJobs *p = priv;
+    RIFFReader *rd;
+    RIFFFile *sub;
+    unsigned int j;
+    const RIFFType *t;
+
+    rd = malloc(sizeof(RIFFReader));
+    if(rd == NULL) {
+        fprintf(stderr, "Failed to allocate memory for reader.\n");
+        goto error0;
+    }
+    riff_reader_init(rd, fileno(p->r->f));
+    trace_thread("index");
+
+    for(;;) {
+        pthread_mutex_lock(&(p->lock));
+        j = p->next;
+        p->next++;
+        pthread_mutex_unlock(&(p->lock));
+        if(j >= p->jobs) {
+            break;
+        }
+
+        /* the subtree root is copied with an absolute offset, so offsets
+           within the subtree come out the same as in the full index */
+        sub = riff_init();
+        if(sub == NULL) {
+            goto error1;
+        }
+        p->result[j] = sub;
+        sub->f = p->r->f;
+        t = RIFF_TYPE(p->r, p->job[j]);
+        if(riff_grow(sub, -1, riff_entry_offset(p->r, p->job[j])) < 0 ||
+           riff_set_type(sub, 0, t->fourCC, t->fourCC2) < 0) {
+            goto error1;
+        }
+        sub->size[0] = p->r->size[p->job[j]];
+
+        if(riff_populate(sub, rd, 0) < 0) {
+            goto error1;
+        }
+    }
+
+    pthread_mutex_lock(&(p->lock));
+    p->r->fallbacks += rd->fallbacks;
+    pthread_mutex_unlock(&(p->lock));
+    free(rd);
+    trace_thread_done();
+    return(NULL);
+
+error1:
+    free(rd);
+    trace_thread_done();
+error0:
+    pthread_mutex_lock(&(p->lock));
+    p->failed = 1;
+    /* stop the others picking up anything more */
+    p->next = p->jobs;
+    pthread_mutex_unlock(&(p->lock));
+    return(NULL);
+}
+
+/* append a populated subtree's entries, fixing up the indices to match */
+int riff_merge(RIFFFile *r, int index, RIFFFile *sub) {
+    int base = r->entryCount - 1;
+    unsigned int i;
+    int cur;
+    const RIFFType *t;
+
+    for(i = 1; i < sub->entryCount; i++) {
+        cur = riff_grow(r, sub->parent[i] == 0 ? index : base + sub->parent[i],
+                        sub->start[i]);
+        if(cur < 0) {
             return(-1);
         }
+        t = RIFF_TYPE(sub, i);
+        if(riff_set_type(r, cur, t->fourCC, t->fourCC2) < 0) {
+            return(-1);
+        }
+        r->size[cur] = sub->size[i];
+    }
+
+    for(i = 0; i < sub->entryCount; i++) {
+        if(sub->node[i] == -1) {
+            continue;
+        }
+        cur = i == 0 ? index : base + (int)i;
+        r->entries[r->node[cur]] = sub->entries[sub->node[i]];
+        if(sub->entries[sub->node[i]] > 0) {
+            r->entry[r->node[cur]] = base + sub->entry[sub->node[i]];
+        }
+    }
+
+    return(0);
+}
+
+/* Scan the first few levels serially, then populate each subtree found under
+   them on its own thread, then merge the results in order. */
+int riff_populate_parallel(RIFFFile *r, RIFFReader *rd, int threads) {
+    PopulateJobs p;
+    pthread_t *thread;
+    int *next;
+    unsigned int nextCount;
+    unsigned int i;
+    int j;
+    int level;
+    int child;
+    unsigned long long start;
+    int ret = -1;
+
+    p.r = r;
+    p.job = malloc(sizeof(int));
+    if(p.job == NULL) {
+        fprintf(stderr, "Failed to allocate memory for jobs.\n");
+        goto error0;
+    }
+    p.job[0] = 0;
+    p.jobs = 1;
+
+    for(level = 0; level < PARALLEL_EXPAND_DEPTH && p.jobs > 0; level++) {
+        start = trace_now();
+        nextCount = 0;
+        for(i = 0; i < p.jobs; i++) {
+            if(riff_scan(r, rd, p.job[i]) < 0) {
+                goto error1;
+            }
+            nextCount += riff_entries(r, p.job[i]);
+        }
+
+        next = malloc(sizeof(int) * (nextCount + 1));
+        if(next == NULL) {
+            fprintf(stderr, "Failed to allocate memory for jobs.\n");
+            goto error1;
+        }
+        nextCount = 0;
+        for(i = 0; i < p.jobs; i++) {
+            for(j = 0; j < riff_entries(r, p.job[i]); j++) {
+                child = r->entry[r->node[p.job[i]]] + j;
+                if(RIFF_TYPE(r, child)->isNode) {
+                    next[nextCount] = child;
+                    nextCount++;
+                }
+            }
+        }
+        free(p.job);
+        p.job = next;
+        p.jobs = nextCount;
+        trace_span(start, "riff_scan", "level %d, %u nodes", level, p.jobs);
+    }
+
+    p.result = calloc(p.jobs + 1, sizeof(RIFFFile *));
+    thread = malloc(sizeof(pthread_t) * threads);
+    if(p.result == NULL || thread == NULL) {
+        fprintf(stderr, "Failed to allocate memory for jobs.\n");
+        goto error2;
+    }
+    if(pthread_mutex_init(&(p.lock), NULL) != 0) {
+        fprintf(stderr, "Failed to create mutex.\n");
+        goto error2;
+    }
+    p.next = 0;
+    p.failed = 0;
+
+    for(j = 0; j < threads; j++) {
+        errno = pthread_create(&(thread[j]), NULL, populate_worker, &p);
+        if(errno != 0) {
+            fprintf(stderr, "Failed to create thread: %s\n", strerror(errno));
+            break;
+        }
+    }
+    if(j == 0) {
+        goto error3;
+    }
+    for(j--; j >= 0; j--) {
+        pthread_join(thread[j], NULL);
+    }
+
+    if(!p.failed) {
+        start = trace_now();
+        for(i = 0; i < p.jobs; i++) {
+            if(riff_merge(r, p.job[i], p.result[i]) < 0) {
+                break;
+            }
+        }
+        if(i == p.jobs) {
+            ret = 0;
+        }
+        trace_span(start, "riff_merge", "%u subtrees", p.jobs);
     }
 
-    return(r->root[index].entries);
+error3:
+    pthread_mutex_destroy(&(p.lock));
+error2:
+    if(p.result != NULL) {
+        for(i = 0; i < p.jobs; i++) {
+            if(p.result[i] != NULL) {
+                riff_free(p.result[i]);
+            }
+        }
+        free(p.result);
+    }
+    free(thread);
+error1:
+    free(p.job);
+error0:
+    return(ret);
 }
 
-RIFFFile *riff_open(const char *filename) {
+RIFFFile *riff_open(const char *filename, int threads) {
+    unsigned long long start = trace_now();
     RIFFFile *r;
     FILE *f;
-    char magic[4];
+    RIFFReader *rd;
+    unsigned int magic;
+    unsigned int fourCC2;
     int size;
+    int ret;
 
     f = fopen(filename, "rb");
     if(f == NULL) {
         fprintf(stderr, "Failed to open SI file for reading.\n");
         goto error0;
     }
-    if(fread(magic, 1, 4, f) < 4) {
+    if(fread(&magic, 1, 4, f) < 4) {
         fprintf(stderr, "Failed to read magic.\n");
         goto error1;
     }
@@ -358,43 +888,64 @@ RIFFFile *riff_open(const char *filename) {
     }
 
     r->f = f;
-    if(riff_grow(r) < 0) {
-        goto error2;
+    /* start after header */
+    if(riff_grow(r, -1, 12) < 0) {
+        goto error3;
     }
-    memcpy(r->root->fourCC, magic, sizeof(r->root->fourCC));
-    if(fread(r->root->fourCC2, 1, sizeof(r->root->fourCC2), f) < sizeof(r->root->fourCC2)) {
+    if(fread(&fourCC2, 1, sizeof(fourCC2), f) < sizeof(fourCC2)) {
         fprintf(stderr, "Failed to read fourCC.\n");
         goto error3;
     }
-    r->root->start = 12; /* start after header */
-    r->root->size = size - 4; /* cut out file fourCC */
-    r->root->entries = 0;
-    r->root->entry = -1;
-    r->root->parent = -1;
+    if(riff_set_type(r, 0, magic, fourCC2) < 0) {
+        goto error3;
+    }
+    r->size[0] = size - 4; /* cut out file fourCC */
 
-    if(riff_populate(r, 0, 0) < 0) {
+    rd = malloc(sizeof(RIFFReader));
+    if(rd == NULL) {
+        fprintf(stderr, "Failed to allocate memory for reader.\n");
+        goto error3;
+    }
+    riff_reader_init(rd, fileno(f));
+    if(threads > 1) {
+        ret = riff_populate_parallel(r, rd, threads);
+    } else {
+        ret = riff_populate(r, rd, 0);
+    }
+    r->fallbacks += rd->fallbacks;
+    free(rd);
+    if(ret < 0) {
         goto error3;
     }
 
+    trace_span(start, "riff_open", "%s, %u entries", filename, r->entryCount);
     return(r);
 
 error3:
-    if(riff_traverse(r, "", print_entry_cb, NULL) < 0) {
-        fprintf(stderr, "Failed to traverse file.\n");
+    if(r->entryCount > 0 && r->node[0] != -1) {
+        if(riff_traverse(r, "", print_entry_cb, NULL) < 0) {
+            fprintf(stderr, "Failed to traverse file.\n");
+        }
     }
-    free(r->root);
 error2:
-    free(r);
+    riff_free(r);
 error1:
     fclose(f);
 error0:
+    trace_span(start, "riff_open", "%s, failed", filename);
     return(NULL);
 }
 
 void riff_free(RIFFFile *r) {
-    if(r->root != NULL) {
-        free(r->root);
-    }
+    free(r->types);
+    free(r->typeSlot);
+    free(r->type);
+    free(r->node);
+    free(r->entry);
+    free(r->entries);
+    free(r->start);
+    free(r->size);
+    free(r->parent);
     free(r);
 }
 
@@ -403,44 +954,72 @@ void riff_close(RIFFFile *r) {
     riff_free(r);
 }
 
+/* turn a string of fourCCs in to a 0 terminated array of integers, compiled
+   must have room for RIFF_PATTERN_MAX + 1 */
+int riff_compile_pattern(const char *pattern, unsigned int *compiled) {
+    unsigned int len = strlen(pattern);
+    unsigned int i;
+
+    if(len % 4) {
+        fprintf(stderr, "Pattern must be mulitple of 4 chars.");
+        return(-1);
+    }
+    if(len / 4 > RIFF_PATTERN_MAX) {
+        fprintf(stderr, "Pattern is too long.\n");
+        return(-1);
+    }
+
+    for(i = 0; i < len / 4; i++) {
+        compiled[i] = FOURCC(pattern[i * 4], pattern[i * 4 + 1],
+                             pattern[i * 4 + 2], pattern[i * 4 + 3]);
+    }
+    compiled[i] = 0;
+
+    return(0);
+}
+
 int do_traverse(RIFFFile *r,
-                const char *pattern,
+                const unsigned int *pattern,
                 int (*match_cb)(RIFFFile *r, int dir, int ent, void *priv),
                 void *priv,
                 int matchAll,
                 int dir) {
-    int index = r->root[dir].entry;
+    int index;
+    int entries;
     int i;
-    const char *fourCC;
+    const RIFFType *t;
     int ret;
 
-    for(i = 0; i < r->root[dir].entries; i++) {
-        if(isNode(r->root[index + i].fourCC)) {
+    /* a leaf, or an entry which was never given a type */
+    if(r->node[dir] == -1) {
+        return(0);
+    }
+    index = r->entry[r->node[dir]];
+    entries = r->entries[r->node[dir]];
+
+    for(i = 0; i < entries; i++) {
+        t = RIFF_TYPE(r, index + i);
+        if(t->isNode) {
             if(matchAll) {
                 ret = match_cb(r, dir, i, priv);
                 if(ret) return(ret);
                 ret = do_traverse(r, NULL, match_cb, priv, matchAll, index + i);
                 if(ret) return(ret);
             } else {
-                if(isLIST(r->root[index + i].fourCC)) {
-                    fourCC = r->root[index + i].fourCC2;
-                } else {
-                    fourCC = r->root[index + i].fourCC;
-                }
-                if(!memcmp(pattern, fourCC, 4)) {
-                     /* no sense recursing if we'd be passing an empty string as
-                     the match may be a directory. */
-                    if(pattern[4] == '\0') {
+                if(pattern[0] == t->key) {
+                     /* no sense recursing if we'd be passing an empty pattern
+                     as the match may be a directory. */
+                    if(pattern[1] == 0) {
                         ret = match_cb(r, dir, i, priv);
                         if(ret) return(ret);
                     } else {
-                        ret = do_traverse(r, &(pattern[4]), match_cb, priv, matchAll, index + i);
+                        ret = do_traverse(r, &(pattern[1]), match_cb, priv, matchAll, index + i);
                         if(ret) return(ret);
                     }
                 }
             }
         } else {
-            if(matchAll || !memcmp(pattern, r->root[index + i].fourCC, 4)) {
+            if(matchAll || pattern[0] == t->key) {
                 ret = match_cb(r, dir, i, priv);
                 if(ret) return(ret);
             }
@@ -454,18 +1033,18 @@ int riff_traverse(RIFFFile *r,
                   const char *pattern,
                   int (*match_cb)(RIFFFile *r, int dir, int ent, void *priv),
                   void *priv) {
+    unsigned int compiled[RIFF_PATTERN_MAX + 1];
     int matchAll = 0;
 
-    if(strlen(pattern) % 4) {
-        fprintf(stderr, "Pattern must be mulitple of 4 chars.");
+    if(riff_compile_pattern(pattern, compiled) < 0) {
         return(-1);
     }
 
-    if(strlen(pattern) == 0) {
+    if(compiled[0] == 0) {
         matchAll = 1;
     }
 
-    return(do_traverse(r, pattern, match_cb, priv, matchAll, 0));
+    return(do_traverse(r, compiled, match_cb, priv, matchAll, 0));
 }
 
 int print_entry_cb(RIFFFile *r, int dir, int ent, void *priv) {
@@ -473,28 +1052,26 @@ int print_entry_cb(RIFFFile *r, int dir, int ent, void *priv) {
     off_t filePos = 0;
     int ent2;
     int index = RIFF_ENTRY(r, dir, ent);
-    const char *fourCC;
+    const RIFFType *t = RIFF_TYPE(r, index);
     char type;
 
-    for(ent2 = index; ent2 != 0; ent2 = r->root[ent2].parent) {
-        filePos += r->root[ent2].start;
+    (void)priv;
+
+    for(ent2 = index; ent2 != 0; ent2 = r->parent[ent2]) {
+        filePos += r->start[ent2];
         depth++;
     }
 
-    fourCC = r->root[index].fourCC;
-    if(isNode(r->root[index].fourCC)) {
-        if(isLIST(r->root[index].fourCC)) {
-            fourCC = r->root[index].fourCC2;
-        }
+    if(t->isNode) {
         type = 'd';
     } else {
         type = 'f';
     }
 
-    printf("%*c %3d %9lu %9lu %8d %c%c%c%c\n", depth, type, ent,
-           r->root[index].start, filePos, r->root[index].size,
-           fourCC[0], fourCC[1], fourCC[2], fourCC[3]);
+    printf("%*c %3d %9u %9lu %8d %c%c%c%c\n", depth, type, ent,
+           r->start[index], filePos, r->size[index],
+           FOURCC_CHAR(t->key, 0), FOURCC_CHAR(t->key, 1),
+           FOURCC_CHAR(t->key, 2), FOURCC_CHAR(t->key, 3));
 
     return(0);
 }
-
@@ -1,43 +1,141 @@
 #include <stdio.h>
 
-#define RIFF_ENTRY(R, DIR, ENT) ((R)->root[(DIR)].entry + (ENT))
+#define RIFF_ENTRY(R, DIR, ENT) ((R)->entry[(R)->node[(DIR)]] + (ENT))
+#define RIFF_TYPE(R, INDEX) (&((R)->types[(R)->type[(INDEX)]]))
 
-typedef struct RIFFEntry_t {
-    char fourCC[4];
-    char fourCC2[4];
-    off_t start;
-    unsigned int size;
+/* fourCCs are kept as they'd be read from the file on a little endian
+   machine, so they can be compared as integers. */
+#define FOURCC(A, B, C, D) ((unsigned int)(unsigned char)(A) | \
+                            ((unsigned int)(unsigned char)(B) << 8) | \
+                            ((unsigned int)(unsigned char)(C) << 16) | \
+                            ((unsigned int)(unsigned char)(D) << 24))
+#define FOURCC_CHAR(FOURCC, N) ((char)((FOURCC) >> ((N) * 8)))
+
+#define RIFF_FOURCC FOURCC('R', 'I', 'F', 'F')
+#define LIST_FOURCC FOURCC('L', 'I', 'S', 'T')
+#define MxSt_FOURCC FOURCC('M', 'x', 'S', 't')
+#define MxHd_FOURCC FOURCC('M', 'x', 'H', 'd')
+#define MxOf_FOURCC FOURCC('M', 'x', 'O', 'f')
+#define pad_FOURCC  FOURCC('p', 'a', 'd', ' ')
+#define MxCh_FOURCC FOURCC('M', 'x', 'C', 'h')
+#define MxOb_FOURCC FOURCC('M', 'x', 'O', 'b')
+#define MxDa_FOURCC FOURCC('M', 'x', 'D', 'a')
+
+/* nodes are scanned for entries until less than this is left */
+#define CHUNK_MINIMUM_SIZE (12)
 
-    int entries;
+/* longest pattern riff_traverse will take, in fourCCs */
+#define RIFF_PATTERN_MAX (16)
 
-    int entry;
+/* types are found by fourCC pair in an open addressed table */
+#define RIFF_INITIAL_TYPE_SLOTS (64)
+/* type of an entry which hasn't been given one, a leaf matching nothing */
+#define RIFF_NO_TYPE (0)
+
+typedef struct {
+    unsigned int fourCC;
+    unsigned int fourCC2;
 
-    int parent;
-} RIFFEntry;
+    /* what traversal patterns match against, fourCC2 for LISTs */
+    unsigned int key;
+    int isNode;
+    int isLIST;
+} RIFFType;
 
+/* Entries are stored as a structure of arrays, so a traversal only touches
+   the type and node arrays.  Children of a node are always contiguous,
+   starting at entry[node[index]].  Offsets are relative to the parent, so they
+   fit in 32 bits. */
 typedef struct {
     FILE *f;
 
-    RIFFEntry *root;
+    /* hot, read for every entry visited */
+    unsigned int *type;
+    int *node; /* -1 for leaves */
+
+    /* per node */
+    int *entry;
+    int *entries;
+    unsigned int nodeCount;
+    unsigned int nodeMemCount;
+
+    /* cold */
+    unsigned int *start;
+    unsigned int *size;
+    int *parent;
+
+    unsigned int entryCount;
     unsigned int entryMemCount;
+
+    RIFFType *types;
+    unsigned int typeCount;
+    unsigned int typeMemCount;
+    /* type indexes + 1 */
+    unsigned int *typeSlot;
+    unsigned int typeSlots;
+
+    /* entries which had to be scanned for */
+    unsigned int fallbacks;
 } RIFFFile;
 
-const char RIFFMagic[4];
-const char LISTFourCC[4];
+#define RIFF_READER_BUFFER (65536)
+#define RIFF_READER_KEEP   (4096)
+#define RIFF_READER_SMALL_READ (4096)
+
+/* buffered positional reads, or forward reads for streams */
+typedef struct {
+    int fd;
+    int stream;
+    off_t pos;
+
+    /* entries which weren't where alignment said they'd be */
+    unsigned int fallbacks;
+
+    off_t bufStart;
+    unsigned int bufLen;
+    unsigned char buf[RIFF_READER_BUFFER];
+} RIFFReader;
+
+/* an entry header as found while scanning a node */
+typedef struct {
+    unsigned int fourCC;
+    unsigned int fourCC2;
+    unsigned int start; /* relative to the node */
+    unsigned int size;
+
+    /* muxed MxObs are read through to find where they end */
+    int forged;
+} RIFFHeader;
+
+extern const char RIFFMagic[4];
 
-int isRIFF(char fourCC[4]);
-int isLIST(char fourCC[4]);
-int isNode(char fourCC[4]);
-int isLeaf(char fourCC[4]);
-int isEntry(char fourCC[4]);
+int isRIFF(unsigned int fourCC);
+int isLIST(unsigned int fourCC);
+int isNode(unsigned int fourCC);
+int isLeaf(unsigned int fourCC);
+int isEntry(unsigned int fourCC);
 int isMuxed(short int type);
+void riff_reader_init(RIFFReader *rd, int fd);
+void riff_reader_init_stream(RIFFReader *rd, int fd);
+unsigned int riff_reader_read(RIFFReader *rd, void *dst, unsigned int size);
+int riff_reader_getc(RIFFReader *rd);
+void riff_reader_seek(RIFFReader *rd, off_t offset, int whence);
+int riff_next_entry(RIFFReader *rd, off_t nodeOffset, unsigned int nodeSize,
+                    off_t *pos, RIFFHeader *h);
 RIFFFile *riff_init();
+int riff_grow(RIFFFile *r, int parent, unsigned int start);
+int riff_set_type(RIFFFile *r, int index, unsigned int fourCC, unsigned int fourCC2);
+int riff_add_child(RIFFFile *r, int index, unsigned int start);
+void riff_drop_child(RIFFFile *r, int index);
+int riff_entries(RIFFFile *r, int index);
 off_t riff_entry_offset(RIFFFile *r, int index);
 int riff_entry_seekto(RIFFFile *r, int index);
-RIFFFile *riff_open(const char *filename);
+RIFFFile *riff_open(const char *filename, int threads);
+void riff_free(RIFFFile *r);
 void riff_close(RIFFFile *r);
+int riff_compile_pattern(const char *pattern, unsigned int *compiled);
 int do_traverse(RIFFFile *r,
-                const char *pattern,
+                const unsigned int *pattern,
                 int (*match_cb)(RIFFFile *r, int dir, int ent, void *priv),
                 void *priv,
                 int matchAll,
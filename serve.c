@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "riff.h"
+#include "hash.h"
+#include "output.h"
+#include "bitmap.h"
+#include "flc.h"
+#include "pipeline.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "song.h"
+#include "serve.h"
+
+/* Indexes for the SI files stay resident and requests come in over a unix
+   socket, one line each:
+
+   LIST <si>          OK <count>, then a "<track num> <type> <name>" line for
+                      each track
+   GET <si> <name>    OK <size>, then the assembled track
+   NUM <si> <num>     the same, for the track with that number
+
+   A name which more than one track has can only be asked for by number.
+   Anything going wrong gets an ERR line.  Songs which were read recently are
+   kept, so asking for them again only has to copy the data out.  Each client
+   is answered on its own thread, and one which goes quiet is hung up on. */
+
+int directory_cb(RIFFFile *r, int dir, int ent, void *priv) {
+    ServeFile *f = priv;
+    ServeAsset *a;
+    Track t;
+    unsigned int i;
+
+    t.index = RIFF_ENTRY(r, dir, ent);
+    song_init(&t);
+
+    if(song_read_mxobs(r, &t) < 0) {
+        goto error0;
+    }
+
+    a = realloc(f->asset, sizeof(ServeAsset) * (f->assets + t.mxobs));
+    if(a == NULL) {
+        fprintf(stderr, "Failed to allocate memory for track directory.\n");
+        goto error0;
+    }
+    f->asset = a;
+
+    for(i = 0; i < t.mxobs; i++) {
+        if(isMuxed(t.mxob[i].trackType)) {
+            continue;
+        }
+        a = &(f->asset[f->assets]);
+        strncpy(a->name, t.mxob[i].trackName, sizeof(a->name));
+        a->trackType = t.mxob[i].trackType;
+        a->trackNum = t.mxob[i].trackNum;
+        a->song = t.index;
+        a->sameName = 0;
+        a->sameNum = 0;
+        f->assets++;
+    }
+
+    song_free(&t);
+
+    return(0);
+
+error0:
+    song_free(&t);
+    return(-1);
+}
+
+/* where the track with this name is, or the empty slot it would go in */
+unsigned int *name_slot(ServeFile *f, const char *name) {
+    unsigned int i = hash_string(name) & (f->slots - 1);
+
+    for(;; i = (i + 1) & (f->slots - 1)) {
+        if(f->nameSlot[i] == 0 ||
+           strcmp(f->asset[f->nameSlot[i] - 1].name, name) == 0) {
+            return(&(f->nameSlot[i]));
+        }
+    }
+}
+
+unsigned int *num_slot(ServeFile *f, unsigned int trackNum) {
+    unsigned int i = trackNum & (f->slots - 1);
+
+    for(;; i = (i + 1) & (f->slots - 1)) {
+        if(f->numSlot[i] == 0 ||
+           f->asset[f->numSlot[i] - 1].trackNum == trackNum) {
+            return(&(f->numSlot[i]));
+        }
+    }
+}
+
+/* the directory doesn't change, so the tables are made once at half full */
+int index_assets(ServeFile *f) {
+    unsigned int *slot;
+    unsigned int i;
+
+    f->slots = SERVE_MIN_SLOTS;
+    while(f->slots < f->assets * 2) {
+        f->slots *= 2;
+    }
+    f->nameSlot = calloc(f->slots, sizeof(unsigned int));
+    f->numSlot = calloc(f->slots, sizeof(unsigned int));
+    if(f->nameSlot == NULL || f->numSlot == NULL) {
+        fprintf(stderr, "Failed to allocate memory for track directory.\n");
+        return(-1);
+    }
+
+    for(i = 0; i < f->assets; i++) {
+        slot = name_slot(f, f->asset[i].name);
+        if(*slot == 0) {
+            *slot = i + 1;
+        } else {
+            f->asset[*slot - 1].sameName = 1;
+        }
+        slot = num_slot(f, f->asset[i].trackNum);
+        if(*slot == 0) {
+            *slot = i + 1;
+        } else {
+            f->asset[*slot - 1].sameNum = 1;
+        }
+    }
+
+    return(0);
+}
+
+int serve_open_file(ServeFile *f, const char *name, int threads) {
+    f->name = name;
+    f->asset = NULL;
+    f->assets = 0;
+    f->nameSlot = NULL;
+    f->numSlot = NULL;
+
+    f->r = riff_open(name, threads);
+    if(f->r == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", name);
+        return(-1);
+    }
+
+    if(riff_traverse(f->r, "MxStMxSt", directory_cb, f) < 0) {
+        fprintf(stderr, "Failed to find tracks in %s.\n", name);
+        return(-1);
+    }
+    if(index_assets(f) < 0) {
+        return(-1);
+    }
+    printf("Serving %u tracks from %s.\n", f->assets, name);
+
+    return(0);
+}
+
+ServeFile *find_file(Server *s, const char *name) {
+    unsigned int i;
+
+    for(i = 0; i < s->files; i++) {
+        if(strcmp(s->file[i].name, name) == 0) {
+            return(&(s->file[i]));
+        }
+    }
+
+    return(NULL);
+}
+
+/* the track asked for by name, or by number when byNum is set */
+ServeAsset *find_asset(ServeFile *f, FILE *reply, const char *trackName,
+                       int byNum) {
+    unsigned long trackNum;
+    unsigned int slot;
+    char *end;
+
+    if(byNum) {
+        trackNum = strtoul(trackName, &end, 10);
+        if(end == trackName || *end != '\0' || trackNum > 0xFFFFFFFFul) {
+            fprintf(reply, "ERR bad track number\n");
+            return(NULL);
+        }
+        slot = *num_slot(f, trackNum);
+    } else {
+        slot = *name_slot(f, trackName);
+    }
+
+    if(slot == 0) {
+        fprintf(reply, "ERR no such track\n");
+        return(NULL);
+    } else if(byNum && f->asset[slot - 1].sameNum) {
+        fprintf(reply, "ERR track number is in more than one song\n");
+        return(NULL);
+    } else if(!byNum && f->asset[slot - 1].sameName) {
+        fprintf(reply, "ERR track name is in more than one song\n");
+        return(NULL);
+    }
+
+    return(&(f->asset[slot - 1]));
+}
+
+void cache_put(Server *s, ServeSong *c) {
+    pthread_mutex_unlock(&(c->lock));
+    pthread_mutex_lock(&(s->lock));
+    c->users--;
+    pthread_mutex_unlock(&(s->lock));
+}
+
+/* find a song in the cache, or read it in place of the one used longest ago
+   which no one else is using.  it's held until given back with cache_put.
+   the slot is claimed under the server lock but read in under its own, so
+   only clients after the same song wait on it. */
+ServeSong *cache_get(Server *s, ServeFile *f, int song) {
+    ServeSong *c;
+    ServeSong *lru = NULL;
+    Track *t;
+    unsigned int i;
+
+    pthread_mutex_lock(&(s->lock));
+    s->clock++;
+    for(i = 0; i < SERVE_CACHE_SONGS; i++) {
+        c = &(s->cache[i]);
+        if(c->f == f && c->song == song) {
+            c->used = s->clock;
+            c->users++;
+            pthread_mutex_unlock(&(s->lock));
+
+            /* held by whoever is still reading it in */
+            pthread_mutex_lock(&(c->lock));
+            if(!c->loaded) {
+                cache_put(s, c);
+                return(NULL);
+            }
+            return(c);
+        }
+        if(c->users == 0 && (lru == NULL || c->used < lru->used)) {
+            lru = c;
+        }
+    }
+
+    if(lru == NULL) {
+        pthread_mutex_unlock(&(s->lock));
+        fprintf(stderr, "Every cached song is in use.\n");
+        return(NULL);
+    }
+    /* no one else is using it, so this can't wait */
+    pthread_mutex_lock(&(lru->lock));
+    lru->f = f;
+    lru->song = song;
+    lru->used = s->clock;
+    lru->users++;
+    pthread_mutex_unlock(&(s->lock));
+
+    t = &(lru->t);
+    if(lru->loaded) {
+        song_free(t);
+        lru->loaded = 0;
+    }
+
+    song_init(t);
+    t->index = song;
+    t->out = NULL;
+    t->rle = 0;
+    t->frameIndex = 0;
+    t->pipeline = NULL;
+    t->dedup = NULL;
+    t->manifest = NULL;
+    t->fingerprint = 0;
+    t->verify = 0;
+    t->fd = fileno(f->r->f);
+
+    if(song_read_mxobs(f->r, t) < 0 ||
+       song_read_chunks(f->r, t) < 0 ||
+       song_size(t) < 0) {
+        song_free(t);
+        /* nothing new finds it, and the ones waiting see it didn't load */
+        pthread_mutex_lock(&(s->lock));
+        lru->f = NULL;
+        pthread_mutex_unlock(&(s->lock));
+        cache_put(s, lru);
+        return(NULL);
+    }
+    lru->loaded = 1;
+
+    return(lru);
+}
+
+int serve_list(Server *s, FILE *reply, const char *name) {
+    ServeFile *f;
+    unsigned int i;
+
+    f = find_file(s, name);
+    if(f == NULL) {
+        fprintf(reply, "ERR no such file\n");
+        return(0);
+    }
+
+    fprintf(reply, "OK %u\n", f->assets);
+    for(i = 0; i < f->assets; i++) {
+        fprintf(reply, "%u %d %s\n", f->asset[i].trackNum,
+                       f->asset[i].trackType, f->asset[i].name);
+    }
+
+    return(0);
+}
+
+int serve_get(Server *s, FILE *reply, Output *out, Pipeline *pipeline,
+              const char *name, const char *trackName, int byNum) {
+    ServeFile *f;
+    ServeAsset *a;
+    ServeSong *c;
+    Track *t;
+    MxOb *o;
+    unsigned int i;
+    int ret = 0;
+
+    f = find_file(s, name);
+    if(f == NULL) {
+        fprintf(reply, "ERR no such file\n");
+        return(0);
+    }
+    a = find_asset(f, reply, trackName, byNum);
+    if(a == NULL) {
+        return(0);
+    }
+
+    c = cache_get(s, f, a->song);
+    if(c == NULL) {
+        fprintf(reply, "ERR failed to read song\n");
+        return(0);
+    }
+    t = &(c->t);
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(o->trackNum == a->trackNum && !isMuxed(o->trackType)) {
+            break;
+        }
+    }
+    if(i == t->mxobs || o->chunks == 0) {
+        fprintf(reply, "ERR track has no data\n");
+        goto error0;
+    }
+
+    fprintf(reply, "OK %u\n", o->size);
+    if(fflush(reply) != 0) {
+        ret = -1;
+        goto error0;
+    }
+
+    t->out = out;
+    t->pipeline = pipeline;
+    if(song_write(t, i) < 0) {
+        /* the client can't tell where the data stops now */
+        ret = -1;
+        goto error0;
+    }
+    printf("Sent %s from %s.\n", a->name, name);
+
+error0:
+    cache_put(s, c);
+    return(ret);
+}
+
+/* requests are answered in order until the client hangs up */
+void *serve_client(void *priv) {
+    ServeClient *client = priv;
+    Server *s = client->s;
+    int fd = client->fd;
+    FILE *in;
+    FILE *reply;
+    Output *out;
+    Pipeline *pipeline;
+    char line[SERVE_LINE_MAX];
+    char *save;
+    char *cmd, *name, *trackName;
+    size_t len;
+    int ret = 0;
+
+    free(client);
+
+    in = fdopen(dup(fd), "r");
+    reply = fdopen(dup(fd), "w");
+    out = output_open_stream(fd);
+    /* songs are kept to be asked for again, so their pages are too */
+    pipeline = pipeline_open(s->writers, 0);
+    if(in == NULL || reply == NULL || out == NULL || pipeline == NULL) {
+        fprintf(stderr, "Failed to set up connection.\n");
+        goto error0;
+    }
+
+    while(ret == 0 && fgets(line, sizeof(line), in) != NULL) {
+        /* timed out part way through a request */
+        if(ferror(in)) {
+            break;
+        }
+        len = strlen(line);
+        if(len > 0 && line[len - 1] != '\n' && !feof(in)) {
+            fprintf(reply, "ERR request too long\n");
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        cmd = strtok_r(line, " ", &save);
+        name = strtok_r(NULL, " ", &save);
+        if(cmd == NULL) {
+            continue;
+        } else if(strcmp(cmd, "LIST") == 0 && name != NULL) {
+            ret = serve_list(s, reply, name);
+        } else if(strcmp(cmd, "GET") == 0 && name != NULL &&
+                  (trackName = strtok_r(NULL, "", &save)) != NULL) {
+            ret = serve_get(s, reply, out, pipeline, name, trackName, 0);
+        } else if(strcmp(cmd, "NUM") == 0 && name != NULL &&
+                  (trackName = strtok_r(NULL, " ", &save)) != NULL) {
+            ret = serve_get(s, reply, out, pipeline, name, trackName, 1);
+        } else {
+            fprintf(reply, "ERR bad request\n");
+        }
+
+        if(fflush(reply) != 0) {
+            break;
+        }
+    }
+
+error0:
+    if(pipeline != NULL) {
+        pipeline_close(pipeline);
+    }
+    if(in != NULL) {
+        fclose(in);
+    }
+    if(reply != NULL) {
+        fclose(reply);
+    }
+    if(out != NULL) {
+        output_close(out);
+    } else {
+        close(fd);
+    }
+    fflush(stdout);
+
+    pthread_mutex_lock(&(s->lock));
+    s->clients--;
+    pthread_cond_signal(&(s->done));
+    pthread_mutex_unlock(&(s->lock));
+
+    return(NULL);
+}
+
+/* hand a connection to a thread of its own, or turn it away when there are
+   too many already */
+void serve_accept(Server *s, int conn) {
+    struct timeval timeout;
+    ServeClient *client;
+    pthread_attr_t attr;
+    pthread_t thread;
+    const char busy[] = "ERR too many clients\n";
+
+    pthread_mutex_lock(&(s->lock));
+    if(s->clients == SERVE_MAX_CLIENTS) {
+        pthread_mutex_unlock(&(s->lock));
+        /* it's being hung up on either way, so it doesn't matter if this
+           doesn't get through */
+        send(conn, busy, sizeof(busy) - 1, MSG_DONTWAIT);
+        close(conn);
+        return;
+    }
+    s->clients++;
+    pthread_mutex_unlock(&(s->lock));
+
+    /* a client that stops reading or writing would hold its thread, and the
+       song it's being sent, forever */
+    timeout.tv_sec = SERVE_TIMEOUT;
+    timeout.tv_usec = 0;
+    if(setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+       setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        fprintf(stderr, "Failed to set timeout on connection: %s\n", strerror(errno));
+        goto error0;
+    }
+
+    client = malloc(sizeof(ServeClient));
+    if(client == NULL) {
+        fprintf(stderr, "Failed to allocate memory for client.\n");
+        goto error0;
+    }
+    client->s = s;
+    client->fd = conn;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    errno = pthread_create(&thread, &attr, serve_client, client);
+    pthread_attr_destroy(&attr);
+    if(errno != 0) {
+        fprintf(stderr, "Failed to create client thread: %s\n", strerror(errno));
+        free(client);
+        goto error0;
+    }
+
+    return;
+
+error0:
+    close(conn);
+    pthread_mutex_lock(&(s->lock));
+    s->clients--;
+    pthread_mutex_unlock(&(s->lock));
+}
+
+int serve(const char *socketName, char **files, int count, int threads,
+          int writers) {
+    Server s;
+    struct sockaddr_un addr;
+    struct stat st;
+    int sock;
+    int conn;
+    int i;
+
+    /* clients going away shouldn't take the server with them */
+    signal(SIGPIPE, SIG_IGN);
+
+    s.writers = writers;
+    s.clock = 0;
+    s.clients = 0;
+    pthread_mutex_init(&(s.lock), NULL);
+    pthread_cond_init(&(s.done), NULL);
+    for(i = 0; i < SERVE_CACHE_SONGS; i++) {
+        s.cache[i].f = NULL;
+        s.cache[i].used = 0;
+        s.cache[i].users = 0;
+        s.cache[i].loaded = 0;
+        pthread_mutex_init(&(s.cache[i].lock), NULL);
+    }
+
+    s.file = calloc(count, sizeof(ServeFile));
+    if(s.file == NULL) {
+        fprintf(stderr, "Failed to allocate memory for served files.\n");
+        return(-1);
+    }
+    for(s.files = 0; s.files < (unsigned int)count; s.files++) {
+        if(serve_open_file(&(s.file[s.files]), files[s.files], threads) < 0) {
+            goto error0;
+        }
+    }
+
+    if(strlen(socketName) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket name too long.\n");
+        goto error0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketName, sizeof(addr.sun_path) - 1);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        goto error0;
+    }
+    /* left over from a server which didn't get to clean up */
+    if(lstat(socketName, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socketName);
+    }
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(sock, SERVE_BACKLOG) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", socketName, strerror(errno));
+        goto error1;
+    }
+    printf("Listening on %s.\n", socketName);
+    fflush(stdout);
+
+    for(;;) {
+        conn = accept(sock, NULL, NULL);
+        if(conn < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+            break;
+        }
+        serve_accept(&s, conn);
+    }
+
+    /* songs can't be freed from under the clients still being answered */
+    pthread_mutex_lock(&(s.lock));
+    while(s.clients > 0) {
+        pthread_cond_wait(&(s.done), &(s.lock));
+    }
+    pthread_mutex_unlock(&(s.lock));
+
+    unlink(socketName);
+error1:
+    close(sock);
+error0:
+    for(i = 0; i < SERVE_CACHE_SONGS; i++) {
+        if(s.cache[i].loaded) {
+            song_free(&(s.cache[i].t));
+        }
+        pthread_mutex_destroy(&(s.cache[i].lock));
+    }
+    pthread_cond_destroy(&(s.done));
+    pthread_mutex_destroy(&(s.lock));
+    for(i = 0; i < count; i++) {
+        free(s.file[i].asset);
+        free(s.file[i].nameSlot);
+        free(s.file[i].numSlot);
+        if(s.file[i].r != NULL) {
+            riff_close(s.file[i].r);
+        }
+    }
+    free(s.file);
+    return(-1);
+}
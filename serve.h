@@ -0,0 +1,70 @@
+#define SERVE_CACHE_SONGS (32)
+#define SERVE_LINE_MAX    (512)
+#define SERVE_BACKLOG     (16)
+#define SERVE_MAX_CLIENTS (64)
+/* seconds a client can leave a request unfinished or its reply unread */
+#define SERVE_TIMEOUT     (30)
+#define SERVE_MIN_SLOTS   (64)
+
+/* every track in a served SI, so a request only needs to find its song */
+typedef struct {
+    char name[64];
+    short int trackType;
+    unsigned int trackNum;
+    int song;
+
+    /* another track in the file has the same name, or number */
+    int sameName;
+    int sameNum;
+} ServeAsset;
+
+typedef struct {
+    const char *name;
+    RIFFFile *r;
+    ServeAsset *asset;
+    unsigned int assets;
+
+    /* open addressed tables of asset indexes + 1, by name and by number,
+       only the first of the tracks sharing either is in them */
+    unsigned int *nameSlot;
+    unsigned int *numSlot;
+    unsigned int slots;
+} ServeFile;
+
+/* a read and sized song, ready to be written again.  it's held by one client
+   at a time while being read in or written, and can't be replaced while any
+   are using or waiting for it. */
+typedef struct {
+    ServeFile *f;
+    int song;
+    Track t;
+    unsigned long used;
+
+    pthread_mutex_t lock;
+    unsigned int users;
+    /* t has been read and sized, only looked at with lock held */
+    int loaded;
+} ServeSong;
+
+typedef struct {
+    ServeFile *file;
+    unsigned int files;
+    int writers;
+
+    /* held to look in or change the cache, or the count of clients */
+    pthread_mutex_t lock;
+    ServeSong cache[SERVE_CACHE_SONGS];
+    unsigned long clock;
+
+    /* each is answered on its own thread */
+    unsigned int clients;
+    pthread_cond_t done;
+} Server;
+
+typedef struct {
+    Server *s;
+    int fd;
+} ServeClient;
+
+int serve(const char *socketName, char **files, int count, int threads,
+          int writers);
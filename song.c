@@ -0,0 +1,1029 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "riff.h"
+#include "hash.h"
+#include "output.h"
+#include "bitmap.h"
+#include "flc.h"
+#include "pipeline.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "song.h"
+#include "trace.h"
+
+const char WAVType[] = {'W', 'A', 'V', 'E'};
+const char fmtHdr[] = {'f', 'm', 't', ' '};
+const char dataHdr[] = {'d', 'a', 't', 'a'};
+
+const char FLCfmt[] = {' ', 'F', 'L', 'C'};
+
+/* traversal patterns used for every song */
+const unsigned int MxObPattern[] = {MxOb_FOURCC, 0};
+const unsigned int MxChMxObPattern[] = {MxCh_FOURCC, MxOb_FOURCC, 0};
+const unsigned int MxChMxChMxObPattern[] =
+    {MxCh_FOURCC, MxCh_FOURCC, MxOb_FOURCC, 0};
+const unsigned int MxChMxChMxChMxObPattern[] =
+    {MxCh_FOURCC, MxCh_FOURCC, MxCh_FOURCC, MxOb_FOURCC, 0};
+const unsigned int MxDaMxChPattern[] = {MxDa_FOURCC, MxCh_FOURCC, 0};
+const unsigned int SongPattern[] = {MxSt_FOURCC, MxSt_FOURCC, 0};
+
+int isFLC(MxOb *o) {
+    if(o->trackType == OMNI_TRACK_TYPE_RAW &&
+       !memcmp(o->format, FLCfmt, sizeof(FLCfmt))) {
+        return(1);
+    }
+
+    return(0);
+}
+
+MxOb *mxob_grow(Track *t) {
+    MxOb *m2;
+
+    m2 = realloc(t->mxob, sizeof(MxOb) * (t->mxobs + 1));
+    if(m2 == NULL) {
+        fprintf(stderr, "Failed to allocate memory to grow MxOb table.\n");
+        return(NULL);
+    }
+
+    t->mxob = m2;
+    t->mxobs++;
+
+    return(&(t->mxob[t->mxobs-1]));
+}
+
+int populate_mxob(Track *t, const unsigned char *buf, unsigned int length) {
+    MxOb *o;
+    unsigned int dataPos = 0;
+    unsigned int nameLength;
+
+    o = mxob_grow(t);
+    if(o == NULL) {
+        return(-1);
+    }
+    o->size = 0;
+    o->chunks = 0;
+    o->read = 0;
+    o->asset = -1;
+    o->hashValid = 0;
+    o->skip = 0;
+    o->unchanged = 0;
+    o->link[0] = '\0';
+
+    o->trackType = SHORT_FROM_ARRAY(buf, dataPos);
+     /* flag as uninitialized */
+    if(o->trackType == OMNI_TRACK_TYPE_WAVE) {
+        o->wav.fileSize = 0;
+    } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP) {
+        o->tga.dataTypeCode = 0;
+    }
+    o->flc.magic = 0;
+    o->partial = 0;
+    o->bitmap.pixels = NULL;
+    flc_index_init(&(o->frames));
+
+    /* If there's a string directly after the value, discard it. */
+    for(dataPos = 2; dataPos < length; dataPos++) {
+        if(buf[dataPos] == 0) {
+            break;
+        }
+    }
+    /* find the start of the name */
+    for(; dataPos < length; dataPos++) {
+        if(buf[dataPos] != 0) {
+            break;
+        }
+    }
+
+    nameLength = strlen((char *)&(buf[dataPos]));
+    if(nameLength >= sizeof(o->trackName)) {
+        fprintf(stderr, "Track name too long.\n");
+        return(-1);
+    }
+    strncpy(o->trackName, (char *)&(buf[dataPos]), sizeof(o->trackName));
+    dataPos += nameLength + 1;
+
+    o->trackNum = INT_FROM_ARRAY(buf, dataPos);
+
+    if(!isMuxed(o->trackType)) {
+        dataPos += 92;
+        nameLength = *(unsigned short int *)&(buf[dataPos]);
+        dataPos += 2;
+        if(nameLength > 0) {
+            dataPos += nameLength;
+        }
+        nameLength = strlen((char *)&(buf[dataPos]));
+        if(nameLength >= sizeof(o->fileName)) {
+            fprintf(stderr, "Track file name too long.\n");
+            return(-1);
+        }
+        strncpy(o->fileName, (char *)&(buf[dataPos]), sizeof(o->fileName));
+        dataPos += nameLength + 1 + 12;
+        memcpy(o->format, &(buf[dataPos]), sizeof(o->format));
+    }
+        
+
+    return(0);
+}
+
+int get_track_info_cb(RIFFFile *r, int dir, int ent, void *priv) {
+    int index = RIFF_ENTRY(r, dir, ent);
+    Track *t = priv;
+    unsigned int MxObLength;
+    unsigned char MxObData[MXOB_MAX_SIZE];
+
+    if(r->size[index] > sizeof(MxObData)) {
+        fprintf(stderr, "MxOb too big.\n");
+        return(-1);
+    }
+
+    /* positional, so songs can be read on several threads at once */
+    MxObLength = r->size[index];
+    if(pread_all(fileno(r->f), MxObData, MxObLength,
+                 riff_entry_offset(r, index)) < 0) {
+        fprintf(stderr, "Failed to read MxOb.\n");
+        return(-1);
+    }
+
+    if(populate_mxob(t, MxObData, MxObLength) < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+Chunk *track_grow(Track *t) {
+    Chunk *c2;
+
+    c2 = realloc(t->c, sizeof(Chunk) * (t->chunks + 1));
+    if(c2 == NULL) {
+        fprintf(stderr, "Failed to allocate memory to grow entry table.\n");
+        return(NULL);
+    }
+
+    t->c = c2;
+    t->chunks++;
+
+    return(&(t->c[t->chunks-1]));
+}
+
+MxOb *get_trackNum(Track *t, unsigned int trackNum) {
+    unsigned int i;
+
+    for(i = 0; i < t->mxobs; i++) {
+        if(t->mxob[i].trackNum == trackNum) {
+            return(&(t->mxob[i]));
+        }
+    }
+
+    return(NULL);
+}
+
+int process_chunk(Track *t, Chunk *c, const unsigned char *hdr);
+
+int read_chunks_cb(RIFFFile *r, int dir, int ent, void *priv) {
+    Track *t = priv;
+    Chunk *c;
+    int index = RIFF_ENTRY(r, dir, ent);
+    unsigned char hdr[OMNI_CHUNK_HEADER_SIZE];
+
+    if(r->size[index] < sizeof(hdr)) {
+        fprintf(stderr, "Chunk too small.\n");
+        return(-1);
+    }
+
+    c = track_grow(t);
+    if(c == NULL) {
+        return(-1);
+    }
+
+    c->size = r->size[index];
+    c->offset = riff_entry_offset(r, index);
+    c->data = NULL;
+    if(pread_all(t->fd, hdr, sizeof(hdr), c->offset) < 0) {
+        return(-1);
+    }
+
+    return(process_chunk(t, c, hdr));
+}
+
+int add_chunk(Track *t, const unsigned char *data, unsigned int size) {
+    Chunk *c;
+
+    if(size < OMNI_CHUNK_HEADER_SIZE) {
+        fprintf(stderr, "Chunk too small.\n");
+        return(-1);
+    }
+
+    c = track_grow(t);
+    if(c == NULL) {
+        return(-1);
+    }
+
+    c->size = size;
+    c->offset = -1;
+    c->data = malloc(size);
+    if(c->data == NULL) {
+        fprintf(stderr, "Failed to allocate memory for chunk.\n");
+        return(-1);
+    }
+    memcpy(c->data, data, size);
+
+    return(process_chunk(t, c, c->data));
+}
+
+/* pull the header fields out of a newly read chunk, and the first chunk of a
+   track is kept for the header it has. */
+int process_chunk(Track *t, Chunk *c, const unsigned char *hdr) {
+    MxOb *o;
+    unsigned char *body;
+    unsigned int size;
+
+    c->chunkType = SHORT_FROM_ARRAY(hdr, 0);
+    c->trackNum = INT_FROM_ARRAY(hdr, 2);
+    c->timestamp = INT_FROM_ARRAY(hdr, 6);
+    c->hdrSize = INT_FROM_ARRAY(hdr, 10);
+
+    o = get_trackNum(t, c->trackNum);
+    if(o == NULL) {
+        fprintf(stderr, "Couldn't find object associated with track %u.\n", c->trackNum);
+        return(-1);
+    }
+    c->mxob = o - t->mxob;
+
+    /* end chunks have nothing in them, so the header is in the first chunk
+       which isn't one, the same one song_size takes it from */
+    if(c->chunkType == OMNI_CHUNK_TYPE_LAST || o->read++ > 0) {
+        return(0);
+    }
+
+    /* the header is read straight out of the chunk, so it has to all be there */
+    size = c->size - OMNI_CHUNK_HEADER_SIZE;
+    if(o->trackType == OMNI_TRACK_TYPE_WAVE && size < OMNI_CHUNK_WAV_FORMAT_SIZE) {
+        fprintf(stderr, "First chunk of %s is %u bytes, too short for a WAV format.\n",
+                        o->trackName, size);
+        return(-1);
+    } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP && size < STL_HEADER_SIZE) {
+        fprintf(stderr, "First chunk of %s is %u bytes, too short for an STL header.\n",
+                        o->trackName, size);
+        return(-1);
+    }
+
+    if(c->data == NULL) {
+        c->data = malloc(c->size);
+        if(c->data == NULL) {
+            fprintf(stderr, "Failed to allocate memory for chunk.\n");
+            return(-1);
+        }
+        if(pread_all(t->fd, c->data, c->size, c->offset) < 0) {
+            return(-1);
+        }
+    }
+
+    body = &(c->data[OMNI_CHUNK_HEADER_SIZE]);
+    if(o->trackType == OMNI_TRACK_TYPE_WAVE && o->wav.fileSize == 0) {
+        /* set up initial fields in track */
+        memcpy(o->wav.RIFF, RIFFMagic, sizeof(o->wav.RIFF));
+        memcpy(o->wav.WAVE, WAVType, sizeof(o->wav.WAVE));
+        memcpy(o->wav.fmt, fmtHdr, sizeof(o->wav.fmt));
+        o->wav.fmtSize = OMNI_CHUNK_WAV_FORMAT_SIZE;
+        memcpy(o->wav.data, dataHdr, sizeof(o->wav.data));
+        o->wav.dataSize = -1;
+        o->wav.fileSize = -1;
+
+        /* fill out what we know */
+        o->wav.format = SHORT_FROM_ARRAY(body, 0);
+        o->wav.channels = SHORT_FROM_ARRAY(body, 2);
+        o->wav.sampleRate = INT_FROM_ARRAY(body, 4);
+        o->wav.bytesPerSecond = INT_FROM_ARRAY(body, 8);
+        o->wav.bytesPerSample = SHORT_FROM_ARRAY(body, 12);
+        o->wav.bitsPerSample = SHORT_FROM_ARRAY(body, 14);
+    } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP && o->tga.dataTypeCode == 0) {
+        /* convert the existing header to Targa. */
+        bitmap_convert_header(&(o->tga), body);
+    } else if(isFLC(o) && o->flc.magic == 0 &&
+              flc_is_header(body, size)) {
+        /* keep the FLIC header so the frame count and sizes can be fixed */
+        memcpy(&(o->flc), body, sizeof(o->flc));
+    }
+
+    return(0);
+}
+
+/* synthesized header written before the first chunk, if any */
+unsigned int mxob_header(MxOb *o, const void **hdr) {
+    if(o->trackType == OMNI_TRACK_TYPE_WAVE) {
+        *hdr = &(o->wav);
+        return(sizeof(o->wav));
+    } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP) {
+        *hdr = &(o->tga);
+        return(sizeof(o->tga));
+    } else if(isFLC(o) && o->flc.magic != 0) {
+        *hdr = &(o->flc);
+        return(sizeof(o->flc));
+    }
+
+    *hdr = NULL;
+    return(0);
+}
+
+/* the part of a chunk which ends up in the output, skip is where it starts
+   in the chunk */
+unsigned int chunk_body(MxOb *o, Chunk *c, int first, unsigned int *skip) {
+    if(first) {
+        /* first chunk is only a header for these, which was converted */
+        if(o->trackType == OMNI_TRACK_TYPE_WAVE ||
+           o->trackType == OMNI_TRACK_TYPE_BITMAP) {
+            *skip = c->size;
+            return(0);
+        }
+        /* the FLIC header is written from the fixed copy */
+        if(isFLC(o) && o->flc.magic != 0) {
+            *skip = OMNI_CHUNK_HEADER_SIZE + sizeof(o->flc);
+            return(c->size - *skip);
+        }
+        /* otherwise it is always fully written */
+    } else if(isFLC(o)) {
+        /* further FLC chunks have some extra data */
+        *skip = OMNI_CHUNK_FLC_HEADER_SIZE + OMNI_CHUNK_HEADER_SIZE;
+        return(c->size - *skip);
+    }
+
+    *skip = OMNI_CHUNK_HEADER_SIZE;
+    return(c->size - *skip);
+}
+
+/* bitmaps go through their own stage so the rows can be padded and the
+   image compressed before the size is known */
+int assemble_bitmap(Track *t, MxOb *o, Bitmap *b) {
+    unsigned int i;
+    unsigned int pos = 0;
+    unsigned char *body;
+    unsigned char *buf = NULL;
+    unsigned int bufSize = 0;
+    int first = 1;
+    Chunk *c;
+
+    for(i = 0; i < t->chunks; i++) {
+        c = &(t->c[i]);
+        if(&(t->mxob[c->mxob]) != o || c->chunkType == OMNI_CHUNK_TYPE_LAST) {
+            continue;
+        }
+
+        if(first) {
+            if(c->data == NULL) {
+                fprintf(stderr, "Header chunk of %s wasn't kept.\n", o->trackName);
+                goto error0;
+            }
+            if(bitmap_init(b, &(o->tga), &(c->data[OMNI_CHUNK_HEADER_SIZE]),
+                           o->size - sizeof(o->tga)) < 0) {
+                goto error0;
+            }
+            first = 0;
+            continue;
+        }
+
+        if(c->data != NULL) {
+            body = &(c->data[c->skip]);
+        } else {
+            if(c->length > bufSize) {
+                free(buf);
+                bufSize = c->length;
+                buf = malloc(bufSize);
+                if(buf == NULL) {
+                    fprintf(stderr, "Failed to allocate memory for bitmap chunk.\n");
+                    goto error1;
+                }
+            }
+            if(pread_all(t->fd, buf, c->length, c->offset + c->skip) < 0) {
+                goto error1;
+            }
+            body = buf;
+        }
+        bitmap_set_data(b, pos, body, c->length);
+        pos += c->length;
+    }
+    free(buf);
+
+    if(bitmap_encode(b, &(o->tga), t->rle) < 0) {
+        bitmap_free(b);
+        return(-1);
+    }
+    o->size = sizeof(o->tga) + b->outSize;
+
+    return(0);
+
+error1:
+    bitmap_free(b);
+error0:
+    free(buf);
+    return(-1);
+}
+
+void print_mxob(MxOb *o) {
+    printf("Name: %s\n"
+           "Type: %d\n"
+           "Track num: %d\n",
+           o->trackName,
+           o->trackType,
+           o->trackNum);
+}
+
+void song_init(Track *t) {
+    t->mxobs = 0;
+    t->mxob = NULL;
+    t->chunks = 0;
+    t->c = NULL;
+}
+
+void song_free(Track *t) {
+    unsigned int i;
+
+    for(i = 0; i < t->mxobs; i++) {
+        flc_index_free(&(t->mxob[i].frames));
+        if(t->mxob[i].bitmap.pixels != NULL) {
+            bitmap_free(&(t->mxob[i].bitmap));
+        }
+    }
+    for(i = 0; i < t->chunks; i++) {
+        free(t->c[i].data);
+    }
+    free(t->mxob);
+    free(t->c);
+    song_init(t);
+}
+
+void print_mxobs(Track *t) {
+    unsigned int i;
+
+    for(i = 0; i < t->mxobs; i++) {
+        printf("Index: %d\n", i);
+        if(isMuxed(t->mxob[i].trackType)) {
+            printf("Muxed MxOb\n");
+        } else {
+            if(t->mxob[i].trackType == OMNI_TRACK_TYPE_WAVE) {
+                printf("WAVE MxOb\n");
+                printf("File name: %s\n",
+                       t->mxob[i].fileName);
+            } else {
+                printf("Raw file data MxOb\n");
+                printf("File name: %s\n",
+                       t->mxob[i].fileName);
+            }
+        }
+        print_mxob(&(t->mxob[i]));
+        printf("\n");
+    }
+}
+
+PipelineOp *add_op(PipelineOp *op, int asset, unsigned int offset,
+                   const void *data, unsigned int size) {
+    op->asset = asset;
+    op->offset = offset;
+    op->size = size;
+    op->data = data;
+    op->fileOffset = -1;
+
+    return(op + 1);
+}
+
+PipelineOp *add_chunk_op(PipelineOp *op, Track *t, Chunk *c) {
+    op->asset = t->mxob[c->mxob].asset;
+    op->offset = c->outOffset;
+    op->size = c->length;
+    op->data = NULL;
+    op->fileOffset = -1;
+    if(c->data != NULL) {
+        op->data = &(c->data[c->skip]);
+    } else {
+        op->fileOffset = c->offset + c->skip;
+    }
+
+    return(op + 1);
+}
+
+/* chunks which are written as they are, bitmaps are assembled first */
+int is_copied(Track *t, Chunk *c) {
+    MxOb *o = &(t->mxob[c->mxob]);
+
+    return(o->asset >= 0 && c->length > 0 &&
+           c->chunkType != OMNI_CHUNK_TYPE_LAST &&
+           o->trackType != OMNI_TRACK_TYPE_BITMAP);
+}
+
+/* size everything up front so headers can be written correctly first, after
+   this the song can be written as many times as needed. */
+int song_size(Track *t) {
+    unsigned int i;
+    const void *hdr;
+    MxOb *o;
+    Chunk *c;
+
+    if(!t->verify) {
+        printf("Read %d chunks.\n", t->chunks);
+    }
+
+    for(i = 0; i < t->chunks; i++) {
+        c = &(t->c[i]);
+        o = &(t->mxob[c->mxob]);
+        c->length = 0;
+
+        if(!t->verify) {
+            printf("%d: %d %d %d\n", i, o->trackNum, c->size, c->timestamp);
+        }
+
+        /* don't care about empty chunks */
+        if(c->chunkType == OMNI_CHUNK_TYPE_LAST) {
+            continue;
+        }
+
+        /* not concerned about the container */
+        if(isMuxed(o->trackType)) {
+            continue;
+        }
+
+        if(o->chunks == 0) {
+            o->size += mxob_header(o, &hdr);
+        }
+        c->length = chunk_body(o, c, o->chunks == 0, &(c->skip));
+        c->outOffset = o->size;
+        if(isFLC(o) && o->chunks > 0) {
+            /* frames may be split over several partial chunks */
+            if(flc_index_add(&(o->frames), o->size, c->length, o->partial) < 0) {
+                return(-1);
+            }
+            o->partial = (c->chunkType == OMNI_CHUNK_TYPE_PARTIAL);
+        }
+        o->size += c->length;
+        o->chunks++;
+    }
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+
+        if(o->chunks == 0) {
+            if(!isMuxed(o->trackType)) {
+                fprintf(stderr, "%s with track number %d never had any packets.\n",
+                                o->trackName, o->trackNum);
+            }
+            continue;
+        }
+
+        if(o->trackType == OMNI_TRACK_TYPE_WAVE) {
+            o->wav.dataSize = o->size - sizeof(o->wav);
+            o->wav.fileSize = o->wav.dataSize + WAV_FILE_SIZE_ADD;
+        } else if(o->trackType == OMNI_TRACK_TYPE_BITMAP) {
+            if(assemble_bitmap(t, o, &(o->bitmap)) < 0) {
+                return(-1);
+            }
+        } else if(isFLC(o) && o->flc.magic != 0) {
+            flc_fix_header(&(o->flc), &(o->frames), o->size);
+        }
+    }
+
+    return(0);
+}
+
+/* write out the tracks of a sized song, or only the MxOb at index only if it
+   isn't negative. */
+int song_write(Track *t, int only) {
+    unsigned int i, j;
+    const void *hdr;
+    unsigned int hdrSize;
+    int positional;
+    int assets = 0;
+    int ret = -1;
+    char name[OUTPUT_NAME_MAX];
+    MxOb *o;
+    OutputAsset *asset;
+    PipelineOp *op, *next;
+
+    /* every track may have a frame index next to it, and every track has a
+       header and a body to be written outside of the chunks. */
+    asset = malloc(sizeof(OutputAsset) * t->mxobs * 2);
+    op = malloc(sizeof(PipelineOp) * (t->chunks + t->mxobs * 3));
+    if(asset == NULL || op == NULL) {
+        fprintf(stderr, "Failed to allocate memory for writing song.\n");
+        goto error0;
+    }
+
+    /* bodies of archive streams have to follow their headers, otherwise
+       everything goes in the order it's in the SI. */
+    positional = output_positional(t->out);
+
+    for(i = 0; i < t->mxobs; i++) {
+        t->mxob[i].asset = -1;
+    }
+
+    next = op;
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+
+        if(o->chunks == 0 || o->skip ||
+           (only >= 0 && i != (unsigned int)only)) {
+            continue;
+        }
+
+        o->asset = assets;
+        if(output_asset_init(t->out, &(asset[assets]), o->trackName, o->size) < 0) {
+            goto error1;
+        }
+        assets++;
+        if(!t->out->discard) {
+            printf("Opened %s.\n", o->trackName);
+        }
+
+        hdrSize = mxob_header(o, &hdr);
+        next = add_op(next, o->asset, 0, hdr, hdrSize);
+
+        if(o->trackType == OMNI_TRACK_TYPE_BITMAP) {
+            next = add_op(next, o->asset, hdrSize,
+                          o->bitmap.out, o->bitmap.outSize);
+        } else if(!positional) {
+            for(j = 0; j < t->chunks; j++) {
+                if(t->c[j].mxob == (int)i && is_copied(t, &(t->c[j]))) {
+                    next = add_chunk_op(next, t, &(t->c[j]));
+                }
+            }
+        }
+
+        /* frame offsets in the output file, in a sidecar next to it */
+        if(t->frameIndex && isFLC(o)) {
+            snprintf(name, sizeof(name), "%s.idx", o->trackName);
+            if(output_asset_init(t->out, &(asset[assets]), name,
+                                 sizeof(FLICFrame) * o->frames.frames) < 0) {
+                goto error1;
+            }
+            next = add_op(next, assets, 0, o->frames.frame,
+                          sizeof(FLICFrame) * o->frames.frames);
+            assets++;
+        }
+    }
+
+    if(positional) {
+        for(i = 0; i < t->chunks; i++) {
+            if(is_copied(t, &(t->c[i]))) {
+                next = add_chunk_op(next, t, &(t->c[i]));
+            }
+        }
+    }
+
+    ret = pipeline_run(t->pipeline, t->out, asset, op, next - op, t->fd);
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(o->asset < 0) {
+            continue;
+        }
+        o->hashValid = (asset[o->asset].hashed == o->size);
+        o->hash = hash_final(&(asset[o->asset].hash));
+        if(ret == 0 && t->frameIndex && isFLC(o) && !t->out->discard) {
+            printf("Wrote %u frame offsets to %s.idx.\n",
+                   o->frames.frames, o->trackName);
+        }
+    }
+
+error1:
+    /* anything which didn't get finished is cleaned up here */
+    for(j = 0; j < (unsigned int)assets; j++) {
+        if(output_asset_end(t->out, &(asset[j])) < 0) {
+            ret = -1;
+        }
+    }
+error0:
+    free(op);
+    free(asset);
+    return(ret);
+}
+
+/* hash every track without writing anything.  the song is read again to be
+   written, so its pages are kept for that. */
+int song_hash(Track *t) {
+    Output *out = t->out;
+    int dropPages;
+    int ret;
+
+    t->out = output_open_discard();
+    if(t->out == NULL) {
+        t->out = out;
+        return(-1);
+    }
+    dropPages = pipeline_drop_pages(t->pipeline, 0);
+    ret = song_write(t, -1);
+    pipeline_drop_pages(t->pipeline, dropPages);
+    output_close(t->out);
+    t->out = out;
+
+    return(ret);
+}
+
+/* the frame index of o is there too, if there should be one */
+int index_present(Track *t, MxOb *o) {
+    char name[OUTPUT_NAME_MAX];
+
+    if(!t->frameIndex || !isFLC(o)) {
+        return(1);
+    }
+    snprintf(name, sizeof(name), "%s.idx", o->trackName);
+
+    return(access(name, F_OK) == 0);
+}
+
+/* everything this song wrote last time is still there, from the same SI.  an
+   output last written by a later song of the SI is going to be written again
+   by that song, so this one doesn't need to. */
+int song_unchanged(Track *t) {
+    ManifestEntry *e;
+    const char *first;
+    unsigned int outputs = 0;
+    unsigned int i;
+    MxOb *o;
+
+    if(t->fingerprint == 0) {
+        return(0);
+    }
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(isMuxed(o->trackType)) {
+            continue;
+        }
+
+        e = manifest_find(t->manifest, o->trackName);
+        if(e == NULL || e->fingerprint != t->fingerprint ||
+           !((e->song == t->index && e->trackNum == o->trackNum) ||
+             e->song > t->index) ||
+           !manifest_unchanged(e) || !index_present(t, o)) {
+            return(0);
+        }
+        outputs++;
+    }
+
+    /* later copies can still be linked to these */
+    if(t->dedup != NULL) {
+        for(i = 0; i < t->mxobs; i++) {
+            o = &(t->mxob[i]);
+            if(isMuxed(o->trackType)) {
+                continue;
+            }
+            e = manifest_find(t->manifest, o->trackName);
+            if(dedup_check(t->dedup, e->hash, e->size, e->name, &first) < 0) {
+                return(-1);
+            }
+        }
+    }
+    t->manifest->unchanged += outputs;
+
+    return(1);
+}
+
+/* skip the tracks which are hashed the same as what was last written and are
+   still there, wherever the SI they came from was */
+void song_keep(Track *t) {
+    ManifestEntry *e;
+    unsigned int i;
+    MxOb *o;
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(o->asset < 0 || !o->hashValid) {
+            continue;
+        }
+
+        e = manifest_find(t->manifest, o->trackName);
+        if(e == NULL || e->size != o->size || e->hash != o->hash ||
+           !manifest_unchanged(e) || !index_present(t, o)) {
+            continue;
+        }
+        o->skip = 1;
+        o->unchanged = 1;
+        t->manifest->unchanged++;
+        printf("%s is unchanged.\n", o->trackName);
+    }
+}
+
+/* find the tracks which were written before, they're linked to the first copy
+   once the song is written.  when done before the song is written, only the
+   new ones are left to write. */
+int song_dedup(Track *t, int written) {
+    const char *first;
+    unsigned int i;
+    int ret;
+    MxOb *o;
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(o->asset < 0 || !o->hashValid) {
+            continue;
+        }
+
+        ret = dedup_check(t->dedup, o->hash, o->size, o->trackName, &first);
+        if(ret < 0) {
+            return(-1);
+        } else if(ret == 0 || o->unchanged) {
+            /* a copy left from the last run is as good as a link */
+            continue;
+        }
+        o->skip = 1;
+
+        /* a link which was just written over has to be made again */
+        if(strcmp(first, o->trackName) == 0 || (ret == 2 && !written)) {
+            printf("%s was already written.\n", o->trackName);
+            continue;
+        }
+        strncpy(o->link, first, sizeof(o->link) - 1);
+        o->link[sizeof(o->link) - 1] = '\0';
+    }
+
+    return(0);
+}
+
+/* the first copy may be from this song, so links are only made after it's
+   written, which also puts them after it in an archive */
+int song_link(Track *t) {
+    char name[OUTPUT_NAME_MAX];
+    char target[OUTPUT_NAME_MAX];
+    unsigned int i;
+    MxOb *o;
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(o->link[0] == '\0') {
+            continue;
+        }
+
+        if(output_link(t->out, o->trackName, o->link) < 0) {
+            return(-1);
+        }
+        printf("Linked %s to %s.\n", o->trackName, o->link);
+        t->dedup->linked++;
+        t->dedup->saved += o->size;
+
+        /* same contents means the same frames too */
+        if(t->frameIndex && isFLC(o)) {
+            snprintf(name, sizeof(name), "%s.idx", o->trackName);
+            snprintf(target, sizeof(target), "%s.idx", o->link);
+            if(output_link(t->out, name, target) < 0) {
+                return(-1);
+            }
+        }
+    }
+
+    return(0);
+}
+
+/* remember what every track ended up as, written or not */
+int song_record(Track *t) {
+    unsigned int i;
+    MxOb *o;
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(o->chunks == 0 || !o->hashValid) {
+            continue;
+        }
+
+        if(manifest_update(t->manifest, o->trackName, t->fingerprint,
+                           t->index, o->trackNum, o->size, o->hash) < 0) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+/* digest, size and chunk count of every track which was assembled */
+void print_digests(Track *t) {
+    unsigned int i;
+    MxOb *o;
+
+    for(i = 0; i < t->mxobs; i++) {
+        o = &(t->mxob[i]);
+        if(o->asset < 0) {
+            continue;
+        }
+
+        if(o->hashValid) {
+            printf("%016llx", o->hash);
+        } else {
+            fprintf(stderr, "%s was assembled out of order and couldn't be hashed.\n",
+                            o->trackName);
+            printf("%16s", "-");
+        }
+        printf(" %10u %6u %s\n", o->size, o->chunks, o->trackName);
+
+        t->tracks++;
+        t->bytes += o->size;
+    }
+}
+
+/* write out all the tracks of a song once its MxObs and chunks are read, the
+   song is freed after */
+int write_song(Track *t) {
+    unsigned long long start;
+    int prehash;
+    int ret = -1;
+
+    start = trace_now();
+    if(song_size(t) < 0) {
+        goto error0;
+    }
+    trace_span(start, "song_size", "%u chunks", t->chunks);
+
+    /* what's unchanged has to be known before it's written, and so do copies
+       going in to an archive.  files are hashed as they're written instead,
+       and copies replaced with links after. */
+    prehash = t->manifest != NULL ||
+              (t->dedup != NULL && !output_relinkable(t->out));
+    if(prehash) {
+        start = trace_now();
+        if(song_hash(t) < 0) {
+            goto error0;
+        }
+        trace_span(start, "song_hash", "%u tracks", t->mxobs);
+    }
+    if(t->manifest != NULL) {
+        song_keep(t);
+    }
+    if(t->dedup != NULL && prehash) {
+        if(song_dedup(t, 0) < 0) {
+            goto error0;
+        }
+    }
+
+    start = trace_now();
+    ret = song_write(t, -1);
+    trace_span(start, "song_write", "%u tracks", t->mxobs);
+    if(ret == 0 && t->dedup != NULL && !prehash) {
+        ret = song_dedup(t, 1);
+    }
+    if(ret == 0 && t->dedup != NULL) {
+        ret = song_link(t);
+    }
+    if(ret == 0 && t->manifest != NULL) {
+        ret = song_record(t);
+    }
+    if(ret == 0 && t->verify) {
+        print_digests(t);
+    }
+
+error0:
+    if(!t->verify) {
+        printf("\n");
+    }
+
+    song_free(t);
+
+    return(ret);
+}
+
+/* MxObs of the song at t->index */
+int song_read_mxobs(RIFFFile *r, Track *t) {
+    unsigned long long start = trace_now();
+
+    if(do_traverse(r, MxObPattern, get_track_info_cb, t, 0, t->index) < 0) {
+        return(-1);
+    }
+
+    if(t->mxob == NULL) {
+        fprintf(stderr, "Failed to find MxOb.\n");
+        return(-1);
+    }
+
+    if(isMuxed(t->mxob[0].trackType)) {
+        if(do_traverse(r, MxChMxObPattern, get_track_info_cb, t, 0, t->index) < 0) {
+            return(-1);
+        }
+    }
+
+    /* some weird ones */
+    if(isMuxed(t->mxob[0].trackType)) {
+        if(do_traverse(r, MxChMxChMxObPattern, get_track_info_cb, t, 0, t->index) < 0) {
+            return(-1);
+        }
+    }
+
+    /* some are even 3 deep! */
+    if(isMuxed(t->mxob[0].trackType)) {
+        if(do_traverse(r, MxChMxChMxChMxObPattern, get_track_info_cb, t, 0, t->index) < 0) {
+            return(-1);
+        }
+    }
+
+    trace_span(start, "song_read_mxobs", "%s, %u MxObs",
+               t->mxob[0].trackName, t->mxobs);
+    return(0);
+}
+
+int song_read_chunks(RIFFFile *r, Track *t) {
+    unsigned long long start = trace_now();
+    int ret;
+
+    ret = do_traverse(r, MxDaMxChPattern, read_chunks_cb, t, 0, t->index);
+    trace_span(start, "song_read_chunks", "%u chunks", t->chunks);
+
+    return(ret);
+}
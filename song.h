@@ -0,0 +1,149 @@
+#define SHORT_FROM_ARRAY(ARRAY, INDEX) (*(short int *)(&((ARRAY)[(INDEX)])))
+#define INT_FROM_ARRAY(ARRAY, INDEX) (*(int *)(&((ARRAY)[(INDEX)])))
+
+#define OMNI_TRACK_TYPE_WAVE    (4)
+#define OMNI_TRACK_TYPE_RAW     (3)
+#define OMNI_TRACK_TYPE_BITMAP  (10)
+
+#define OMNI_CHUNK_HEADER_SIZE (14)
+#define OMNI_CHUNK_FLC_HEADER_SIZE (20)
+/* format fields at the start of the first chunk of a WAV track */
+#define OMNI_CHUNK_WAV_FORMAT_SIZE (16)
+
+#define OMNI_CHUNK_TYPE_DATA (0)
+#define OMNI_CHUNK_TYPE_PARTIAL (16)
+#define OMNI_CHUNK_TYPE_LAST (2)
+
+#define MXOB_MAX_SIZE (65536)
+
+typedef struct __attribute__((packed)) {
+    char RIFF[4];
+    int fileSize;
+    char WAVE[4];
+    char fmt[4];
+    int fmtSize;
+    short int format;
+    short int channels;
+    int sampleRate;
+    int bytesPerSecond;
+    short int bytesPerSample;
+    short int bitsPerSample;
+    char data[4];
+    int dataSize;
+} WAVHeader;
+
+#define WAV_FILE_SIZE_OFFSET (4)
+#define WAV_DATA_SIZE_OFFSET (40)
+#define WAV_FILE_SIZE_ADD    (sizeof(WAVHeader) - 8)
+
+typedef struct {
+    unsigned int size;
+    /* the whole chunk is only kept when it's the first of its track or when
+       reading a stream, otherwise it's read again from offset when written. */
+    unsigned char *data;
+    off_t offset;
+
+    /* required fields */
+    short int chunkType;
+    int trackNum;
+    int timestamp;
+    int hdrSize;
+
+    /* what ends up in the output, and where */
+    int mxob;
+    unsigned int skip;
+    unsigned int length;
+    unsigned int outOffset;
+} Chunk;
+
+typedef struct {
+    /* computed from the chunks before anything is written */
+    unsigned int size;
+    unsigned int chunks;
+    unsigned int read;
+    int asset;
+
+    /* of what was last written, if it could be worked out */
+    unsigned long long hash;
+    int hashValid;
+    /* not written, it's the same as something already written */
+    int skip;
+    /* what was written by the last run is still there */
+    int unchanged;
+    /* first copy it's linked to once the song is written, or empty */
+    char link[64];
+
+    /* for WAV tracks */
+    WAVHeader wav;
+
+    /* for STL bitmap objects, assembled when the song is sized */
+    TGAHeader tga;
+    Bitmap bitmap;
+
+    /* for FLC raw tracks */
+    FLICHeader flc;
+    FLICIndex frames;
+    int partial;
+
+    char trackName[64];
+    short int trackType;
+    unsigned int trackNum;
+
+    /* for muxed types, these values are not in the main MxOb */
+    char fileName[256];
+    char format[4];
+} MxOb;
+
+typedef struct {
+    int index;
+    Output *out;
+    int rle;
+    int frameIndex;
+    /* what everything is written through, shared by every song */
+    Pipeline *pipeline;
+    /* NULL unless only assets which haven't been seen before are written */
+    Dedup *dedup;
+    /* NULL unless outputs of the last run are kept when they're the same */
+    Manifest *manifest;
+    /* of the SI, 0 when it can't be told apart from any other */
+    unsigned long long fingerprint;
+    /* nothing is written, only digests of what was assembled are printed */
+    int verify;
+    /* tracks verified so far and their total size */
+    unsigned int tracks;
+    unsigned long long bytes;
+
+    /* the SI, or -1 when reading a stream */
+    int fd;
+
+    MxOb *mxob;
+    unsigned int mxobs;
+
+    /* fields from first audio chunk */
+    /* WAV fmt header */
+
+    Chunk *c;
+    unsigned int chunks;
+} Track;
+
+extern const unsigned int MxObPattern[];
+extern const unsigned int MxChMxObPattern[];
+extern const unsigned int MxChMxChMxObPattern[];
+extern const unsigned int MxChMxChMxChMxObPattern[];
+extern const unsigned int MxDaMxChPattern[];
+extern const unsigned int SongPattern[];
+
+int isFLC(MxOb *o);
+int populate_mxob(Track *t, const unsigned char *buf, unsigned int length);
+MxOb *get_trackNum(Track *t, unsigned int trackNum);
+int add_chunk(Track *t, const unsigned char *data, unsigned int size);
+void print_mxob(MxOb *o);
+void print_mxobs(Track *t);
+void song_init(Track *t);
+void song_free(Track *t);
+int song_read_mxobs(RIFFFile *r, Track *t);
+int song_read_chunks(RIFFFile *r, Track *t);
+int song_size(Track *t);
+int song_write(Track *t, int only);
+int song_unchanged(Track *t);
+int write_song(Track *t);
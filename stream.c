@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riff.h"
+#include "stream.h"
+
+#define CHUNK_MINIMUM_SIZE      (12)
+
+typedef struct {
+    RIFFStreamEntry e;
+
+    /* how far in to the node it's been scanned */
+    off_t pos;
+    int entries;
+} StreamNode;
+
+/* does the path below depth down to this entry match a 0 terminated
+   pattern */
+int riff_stream_match(const RIFFStreamEntry *e, int depth, const unsigned int *pattern) {
+    int i;
+
+    for(i = 0; pattern[i] != 0; i++) {
+        if(depth + 1 + i > e->depth || e->path[depth + 1 + i] != pattern[i]) {
+            return(0);
+        }
+    }
+
+    return(depth + i == e->depth);
+}
+
+void stream_entry_set(RIFFStreamEntry *e, unsigned int fourCC, unsigned int fourCC2) {
+    e->fourCC = fourCC;
+    e->fourCC2 = fourCC2;
+    e->isNode = isNode(fourCC);
+    e->key = isLIST(fourCC) ? fourCC2 : fourCC;
+}
+
+/* Walk the file strictly front to back, calling entry_cb for each entry as
+   it's found and leave_cb for each node once everything in it has been seen.
+   Nodes are descended in to as soon as they're found, keeping a stack of the
+   ones which are open rather than coming back to them, so nothing is read
+   twice and no seeking is needed. */
+int riff_stream(int fd,
+                int readLeaves,
+                int (*entry_cb)(const RIFFStreamEntry *e, void *priv),
+                int (*leave_cb)(const RIFFStreamEntry *e, void *priv),
+                void *priv,
+                unsigned int *fallbacks) {
+    RIFFReader *rd;
+    StreamNode stack[RIFF_STREAM_MAX_DEPTH];
+    unsigned int path[RIFF_STREAM_MAX_DEPTH + 1];
+    StreamNode *n;
+    RIFFStreamEntry e;
+    RIFFHeader h;
+    unsigned int magic;
+    unsigned int fourCC2;
+    unsigned int size;
+    unsigned char *data = NULL;
+    unsigned int dataMem = 0;
+    unsigned char *d;
+    int top;
+    int ret = -1;
+
+    rd = malloc(sizeof(RIFFReader));
+    if(rd == NULL) {
+        fprintf(stderr, "Failed to allocate memory for reader.\n");
+        goto error0;
+    }
+    riff_reader_init_stream(rd, fd);
+
+    if(riff_reader_read(rd, &magic, sizeof(magic)) < sizeof(magic) ||
+       riff_reader_read(rd, &size, sizeof(size)) < sizeof(size) ||
+       riff_reader_read(rd, &fourCC2, sizeof(fourCC2)) < sizeof(fourCC2)) {
+        fprintf(stderr, "Failed to read RIFF header.\n");
+        goto error1;
+    }
+    if(!isRIFF(magic)) {
+        fprintf(stderr, "File is not a RIFF file.\n");
+        goto error1;
+    }
+
+    /* the root itself isn't passed to the callbacks, same as traversal */
+    n = &(stack[0]);
+    stream_entry_set(&(n->e), magic, fourCC2);
+    n->e.depth = 0;
+    n->e.ent = 0;
+    n->e.start = 12; /* start after header */
+    n->e.offset = 12;
+    n->e.size = size - 4; /* cut out file fourCC */
+    n->e.data = NULL;
+    n->e.path = path;
+    n->pos = 0;
+    n->entries = 0;
+    path[0] = n->e.key;
+    top = 0;
+
+    while(top >= 0) {
+        n = &(stack[top]);
+
+        if(n->pos + CHUNK_MINIMUM_SIZE >= n->e.size) {
+            /* done with this node, skip whatever's left of it */
+            if(top > 0) {
+                if(leave_cb != NULL && leave_cb(&(n->e), priv)) {
+                    goto error2;
+                }
+                stack[top - 1].pos = n->e.start + n->e.size;
+            }
+            riff_reader_seek(rd, n->e.offset + n->e.size, SEEK_SET);
+            top--;
+            continue;
+        }
+
+        if(riff_next_entry(rd, n->e.offset, n->e.size, &(n->pos), &h) < 0) {
+            goto error2;
+        }
+
+        stream_entry_set(&e, h.fourCC, h.fourCC2);
+        e.depth = top + 1;
+        e.ent = n->entries;
+        e.start = h.start;
+        e.offset = n->e.offset + h.start;
+        e.size = h.size;
+        e.data = NULL;
+        e.path = path;
+        path[e.depth] = e.key;
+        n->entries++;
+
+        if(e.isNode) {
+            if(top + 1 >= RIFF_STREAM_MAX_DEPTH) {
+                fprintf(stderr, "Nodes nested too deeply near %ld.\n", (long)e.offset);
+                goto error2;
+            }
+            if(entry_cb(&e, priv)) {
+                goto error2;
+            }
+
+            top++;
+            stack[top].e = e;
+            stack[top].pos = 0;
+            stack[top].entries = 0;
+            continue;
+        }
+
+        if(readLeaves) {
+            if(e.size > dataMem) {
+                d = realloc(data, e.size);
+                if(d == NULL) {
+                    fprintf(stderr, "Failed to allocate memory for entry data.\n");
+                    goto error2;
+                }
+                data = d;
+                dataMem = e.size;
+            }
+
+            /* forged MxObs have already been read past, but they're small
+               enough to still be in the buffer */
+            riff_reader_seek(rd, e.offset, SEEK_SET);
+            if(riff_reader_read(rd, data, e.size) < e.size) {
+                fprintf(stderr, "Failed to read entry data.\n");
+                goto error2;
+            }
+            e.data = data;
+        }
+
+        if(entry_cb(&e, priv)) {
+            goto error2;
+        }
+
+        if(!h.forged) {
+            n->pos += h.size;
+        }
+        riff_reader_seek(rd, e.offset + e.size, SEEK_SET);
+    }
+
+    ret = 0;
+
+error2:
+    if(fallbacks != NULL) {
+        *fallbacks = rd->fallbacks;
+    }
+    free(data);
+error1:
+    free(rd);
+error0:
+    return(ret);
+}
+
+/* same output as print_entry_cb */
+int print_stream_entry_cb(const RIFFStreamEntry *e, void *priv) {
+    (void)priv;
+
+    printf("%*c %3d %9u %9lu %8d %c%c%c%c\n", e->depth + 1, e->isNode ? 'd' : 'f',
+           e->ent, e->start, (unsigned long)(e->offset - 12), e->size,
+           FOURCC_CHAR(e->key, 0), FOURCC_CHAR(e->key, 1),
+           FOURCC_CHAR(e->key, 2), FOURCC_CHAR(e->key, 3));
+
+    return(0);
+}
@@ -0,0 +1,34 @@
+/* deepest nesting of nodes a stream can have */
+#define RIFF_STREAM_MAX_DEPTH (32)
+
+typedef struct {
+    unsigned int fourCC;
+    unsigned int fourCC2;
+    unsigned int key;
+    int isNode;
+
+    /* children of the root are depth 1 */
+    int depth;
+    /* number within its parent */
+    int ent;
+    /* relative to the parent */
+    unsigned int start;
+    /* absolute offset of the data */
+    off_t offset;
+    unsigned int size;
+
+    /* leaf data, if the stream was asked to read it */
+    const unsigned char *data;
+
+    /* keys of this entry and the nodes it's in, path[depth] is this entry's */
+    const unsigned int *path;
+} RIFFStreamEntry;
+
+int riff_stream_match(const RIFFStreamEntry *e, int depth, const unsigned int *pattern);
+int riff_stream(int fd,
+                int readLeaves,
+                int (*entry_cb)(const RIFFStreamEntry *e, void *priv),
+                int (*leave_cb)(const RIFFStreamEntry *e, void *priv),
+                void *priv,
+                unsigned int *fallbacks);
+int print_stream_entry_cb(const RIFFStreamEntry *e, void *priv);
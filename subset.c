@@ -0,0 +1,367 @@
+/* for copy_file_range */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "riff.h"
+#include "hash.h"
+#include "output.h"
+#include "bitmap.h"
+#include "flc.h"
+#include "pipeline.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "song.h"
+#include "subset.h"
+
+/* A new SI with only some of the songs, picked by the name of any of their
+   MxObs.  Songs are copied whole, so only the sizes of the RIFF and the LIST
+   around them change, along with the offsets in MxOf.  Objects which aren't
+   kept get a 0 in MxOf so the rest keep their numbers.
+
+   Nothing in a song may cross a buffer boundary, so each song is put at the
+   same offset within a buffer as it was, with a pad entry before it.  Pads are
+   never written, they're left as holes. */
+
+/* copy size bytes from in at inPos to out at outPos, without them coming out
+   of the kernel if it can do that */
+int copy_range(int in, off_t inPos, int out, off_t outPos, off_t size) {
+    unsigned char *buf;
+    unsigned int count;
+    ssize_t ret;
+
+    while(size > 0) {
+        ret = copy_file_range(in, &inPos, out, &outPos, size, 0);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            /* different filesystems or an old kernel */
+            if(errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+               errno == EOPNOTSUPP) {
+                break;
+            }
+            fprintf(stderr, "Failed to copy song: %s\n", strerror(errno));
+            return(-1);
+        } else if(ret == 0) {
+            fprintf(stderr, "Song runs past the end of the file.\n");
+            return(-1);
+        }
+        size -= ret;
+    }
+    if(size == 0) {
+        return(0);
+    }
+
+    buf = malloc(SUBSET_COPY_BUFFER);
+    if(buf == NULL) {
+        fprintf(stderr, "Failed to allocate memory for copying.\n");
+        return(-1);
+    }
+    while(size > 0) {
+        count = size > SUBSET_COPY_BUFFER ? SUBSET_COPY_BUFFER : size;
+        if(pread_all(in, buf, count, inPos) < 0) {
+            goto error0;
+        }
+        if(pwrite_all(out, buf, count, outPos) < 0) {
+            fprintf(stderr, "Failed to write song: %s\n", strerror(errno));
+            goto error0;
+        }
+        inPos += count;
+        outPos += count;
+        size -= count;
+    }
+    free(buf);
+
+    return(0);
+
+error0:
+    free(buf);
+    return(-1);
+}
+
+int entry_compare(const void *a, const void *b) {
+    const off_t *from = a;
+    const SubsetEntry *e = b;
+
+    if(*from < e->from) {
+        return(-1);
+    } else if(*from > e->from) {
+        return(1);
+    }
+    return(0);
+}
+
+int write_header(int fd, unsigned int fourCC, unsigned int size,
+                 const unsigned int *fourCC2, off_t pos) {
+    unsigned int hdr[3];
+
+    hdr[0] = fourCC;
+    hdr[1] = size;
+    if(fourCC2 != NULL) {
+        hdr[2] = *fourCC2;
+    }
+    if(pwrite_all(fd, hdr, fourCC2 != NULL ? 12 : 8, pos) < 0) {
+        fprintf(stderr, "Failed to write entry header: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* where the header of an entry is and how much of the file it takes */
+off_t entry_header(RIFFFile *r, int index, unsigned int *size) {
+    unsigned int hdrSize = RIFF_TYPE(r, index)->isLIST ? 12 : 8;
+
+    *size = hdrSize + r->size[index] + (r->size[index] & 1);
+    return(riff_entry_offset(r, index) - hdrSize);
+}
+
+/* whether the song at index is one of names, which are marked once found */
+int is_selected(RIFFFile *r, int index, char **names, int count, int *found) {
+    Track t;
+    unsigned int i;
+    int j;
+    int ret = 0;
+
+    t.index = index;
+    song_init(&t);
+    if(song_read_mxobs(r, &t) < 0) {
+        song_free(&t);
+        return(-1);
+    }
+
+    for(i = 0; i < t.mxobs; i++) {
+        for(j = 0; j < count; j++) {
+            if(strcmp(t.mxob[i].trackName, names[j]) == 0) {
+                found[j] = 1;
+                ret = 1;
+            }
+        }
+    }
+    song_free(&t);
+
+    return(ret);
+}
+
+/* lay out the songs of the list at index which are kept from pos on, returns
+   where the list ends or -1 */
+off_t subset_list(RIFFFile *r, int index, off_t pos, unsigned int bufferSize,
+                  char **names, int count, int *found,
+                  SubsetEntry *keep, unsigned int *kept) {
+    SubsetEntry *e;
+    off_t gap;
+    int songs;
+    int ent;
+    int ret;
+    int child;
+
+    songs = riff_entries(r, index);
+    for(ent = 0; ent < songs; ent++) {
+        child = RIFF_ENTRY(r, index, ent);
+        if(RIFF_TYPE(r, child)->key != MxSt_FOURCC) {
+            continue;
+        }
+        ret = is_selected(r, child, names, count, found);
+        if(ret < 0) {
+            return(-1);
+        } else if(ret == 0) {
+            continue;
+        }
+
+        e = &(keep[*kept]);
+        e->from = entry_header(r, child, &(e->size));
+
+        /* a song pushed forward by a pad can put pos past where the next
+           one was, so keep the gap positive */
+        if(bufferSize > 0) {
+            gap = ((e->from - pos) % (off_t)bufferSize + bufferSize) % bufferSize;
+            if(gap > 0 && gap < SUBSET_PAD_MIN) {
+                gap += bufferSize;
+            }
+            pos += gap;
+        }
+        e->to = pos;
+        pos += e->size;
+        (*kept)++;
+    }
+
+    return(pos);
+}
+
+int subset(const char *inName, const char *outName, char **names, int count,
+           int threads) {
+    RIFFFile *r;
+    SubsetEntry *keep = NULL;
+    unsigned int kept = 0;
+    int *found = NULL;
+    int in, out;
+    int entries, ent, index;
+    int list = -1;
+    int mxof = -1;
+    unsigned int listSize;
+    off_t listPos = 0;
+    off_t mxofPos = 0;
+    off_t pos, from;
+    off_t end = 0;
+    unsigned int size;
+    unsigned int hdr[2];
+    unsigned int bufferSize = 0;
+    unsigned int *offsets = NULL;
+    SubsetEntry *e;
+    unsigned int i;
+    unsigned int fourCC2;
+    int ret = -1;
+
+    r = riff_open(inName, threads);
+    if(r == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", inName);
+        return(-1);
+    }
+    in = fileno(r->f);
+
+    keep = malloc(sizeof(SubsetEntry) * r->entryCount);
+    found = calloc(count, sizeof(int));
+    if(keep == NULL || found == NULL) {
+        fprintf(stderr, "Failed to allocate memory for subset.\n");
+        goto error0;
+    }
+
+    out = open(outName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", outName, strerror(errno));
+        goto error0;
+    }
+
+    /* everything at the top is copied as it is but the songs, MxOf is
+       written once it's known where they went */
+    pos = 12;
+    entries = riff_entries(r, 0);
+    for(ent = 0; ent < entries; ent++) {
+        index = RIFF_ENTRY(r, 0, ent);
+        from = entry_header(r, index, &size);
+
+        if(RIFF_TYPE(r, index)->fourCC == MxHd_FOURCC && r->size[index] >= 8) {
+            if(pread_all(in, (unsigned char *)hdr, 8, from + 8) < 0) {
+                goto error1;
+            }
+            bufferSize = hdr[1];
+        }
+
+        if(RIFF_TYPE(r, index)->isLIST &&
+           RIFF_TYPE(r, index)->key == MxSt_FOURCC && list < 0) {
+            list = index;
+            listPos = pos;
+            end = subset_list(r, index, pos + 12, bufferSize,
+                              names, count, found, keep, &kept);
+            if(end < 0) {
+                goto error1;
+            }
+            pos = end + ((end - listPos) & 1);
+            continue;
+        }
+
+        if(RIFF_TYPE(r, index)->fourCC == MxOf_FOURCC && mxof < 0) {
+            mxof = index;
+            mxofPos = pos;
+        }
+        if(copy_range(in, from, out, pos, size) < 0) {
+            goto error1;
+        }
+        pos += size;
+    }
+
+    for(i = 0; i < (unsigned int)count; i++) {
+        if(!found[i]) {
+            fprintf(stderr, "No song named %s.\n", names[i]);
+            goto error1;
+        }
+    }
+    if(list < 0) {
+        fprintf(stderr, "No songs in %s.\n", inName);
+        goto error1;
+    }
+    /* sizes in the RIFF header are 32 bits */
+    if(pos - 8 > UINT_MAX) {
+        fprintf(stderr, "Subset would be %lld bytes, too big for an SI.\n",
+                        (long long)pos);
+        goto error1;
+    }
+
+    for(i = 0; i < kept; i++) {
+        if(copy_range(in, keep[i].from, out, keep[i].to, keep[i].size) < 0) {
+            goto error1;
+        }
+        /* pads are only headers, the rest is a hole */
+        from = i == 0 ? listPos + 12 : keep[i - 1].to + keep[i - 1].size;
+        if(keep[i].to > from &&
+           write_header(out, pad_FOURCC, keep[i].to - from - 8, NULL, from) < 0) {
+            goto error1;
+        }
+    }
+
+    listSize = (end - listPos) - 8;
+    fourCC2 = MxSt_FOURCC;
+    if(write_header(out, LIST_FOURCC, listSize, &fourCC2, listPos) < 0) {
+        goto error1;
+    }
+    fourCC2 = RIFF_TYPE(r, 0)->fourCC2;
+    if(write_header(out, RIFF_FOURCC, pos - 8, &fourCC2, 0) < 0) {
+        goto error1;
+    }
+    /* the last song might have ended on a pad byte which was never written */
+    if(ftruncate(out, pos) < 0) {
+        fprintf(stderr, "Failed to size %s: %s\n", outName, strerror(errno));
+        goto error1;
+    }
+
+    /* offsets of songs which are gone become 0, the first value is how many
+       there are */
+    if(mxof >= 0 && r->size[mxof] >= 4) {
+        size = r->size[mxof] & ~3;
+        offsets = malloc(size);
+        if(offsets == NULL) {
+            fprintf(stderr, "Failed to allocate memory for MxOf.\n");
+            goto error1;
+        }
+        if(pread_all(in, (unsigned char *)offsets, size,
+                     riff_entry_offset(r, mxof)) < 0) {
+            goto error1;
+        }
+
+        for(i = 1; i < size / sizeof(unsigned int); i++) {
+            from = offsets[i];
+            e = bsearch(&from, keep, kept, sizeof(SubsetEntry), entry_compare);
+            offsets[i] = e == NULL ? 0 : e->to;
+        }
+
+        if(pwrite_all(out, offsets, size, mxofPos + 8) < 0) {
+            fprintf(stderr, "Failed to write MxOf: %s\n", strerror(errno));
+            goto error1;
+        }
+    }
+
+    printf("Kept %u songs, %lld bytes.\n", kept, (long long)pos);
+    ret = 0;
+
+error1:
+    if(close(out) < 0 && ret == 0) {
+        fprintf(stderr, "Failed to close %s: %s\n", outName, strerror(errno));
+        ret = -1;
+    }
+    /* don't leave half an SI around */
+    if(ret < 0) {
+        unlink(outName);
+    }
+error0:
+    free(offsets);
+    free(found);
+    free(keep);
+    riff_close(r);
+    return(ret);
+}
@@ -0,0 +1,15 @@
+#define SUBSET_COPY_BUFFER (65536)
+/* smallest pad entry, just its header */
+#define SUBSET_PAD_MIN (8)
+
+/* a top level MxSt which is kept, where it was and where it goes, both at its
+   header */
+typedef struct {
+    off_t from;
+    off_t to;
+    /* with the header and any pad byte after it */
+    unsigned int size;
+} SubsetEntry;
+
+int subset(const char *inName, const char *outName, char **names, int count,
+           int threads);
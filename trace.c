@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+/* Spans of time spent on each thread, written out at the end as Chrome
+   trace-event JSON to be loaded in to a trace viewer.  Each thread keeps its
+   own events so recording never takes a lock, except to find a row the first
+   time a thread records anything. */
+
+int Tracing = 0;
+char *TraceFilename = NULL;
+unsigned long long TraceStart;
+unsigned int TraceDropped;
+
+pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+TraceThread *TraceThreads = NULL;
+int TraceTids = 0;
+__thread TraceThread *TraceCurrent = NULL;
+
+unsigned long long clock_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+int trace_open(const char *filename) {
+    TraceFilename = strdup(filename);
+    if(TraceFilename == NULL) {
+        fprintf(stderr, "Failed to allocate memory for trace.\n");
+        return(-1);
+    }
+    TraceStart = clock_ns();
+    TraceDropped = 0;
+    Tracing = 1;
+    trace_thread("main");
+
+    return(0);
+}
+
+/* 0 when not tracing, so it's cheap to call everywhere */
+unsigned long long trace_now() {
+    if(!Tracing) {
+        return(0);
+    }
+
+    return(clock_ns());
+}
+
+/* use the first free row by this name, or start a new one */
+void trace_thread(const char *name) {
+    TraceThread *t;
+
+    if(!Tracing) {
+        return;
+    }
+
+    pthread_mutex_lock(&TraceLock);
+    for(t = TraceThreads; t != NULL; t = t->next) {
+        if(!t->inUse && strcmp(t->name, name) == 0) {
+            break;
+        }
+    }
+    if(t == NULL) {
+        t = malloc(sizeof(TraceThread));
+        if(t != NULL) {
+            strncpy(t->name, name, sizeof(t->name) - 1);
+            t->name[sizeof(t->name) - 1] = '\0';
+            TraceTids++;
+            t->tid = TraceTids;
+            t->event = NULL;
+            t->events = 0;
+            t->eventMem = 0;
+            t->next = TraceThreads;
+            TraceThreads = t;
+        }
+    }
+    if(t != NULL) {
+        t->inUse = 1;
+    }
+    pthread_mutex_unlock(&TraceLock);
+
+    TraceCurrent = t;
+}
+
+/* let the row go to the next thread by this name */
+void trace_thread_done() {
+    if(TraceCurrent == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&TraceLock);
+    TraceCurrent->inUse = 0;
+    pthread_mutex_unlock(&TraceLock);
+
+    TraceCurrent = NULL;
+}
+
+/* record a span from start until now on this thread, with format giving
+   something to tell it apart from the others by the same name */
+void trace_span(unsigned long long start, const char *name,
+                const char *format, ...) {
+    TraceThread *t = TraceCurrent;
+    TraceEvent *e;
+    va_list ap;
+
+    if(!Tracing) {
+        return;
+    }
+
+    /* a thread which was never named, or its row couldn't be allocated */
+    if(t == NULL) {
+        __atomic_add_fetch(&TraceDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if(t->events == t->eventMem) {
+        e = realloc(t->event, sizeof(TraceEvent) *
+                              (t->eventMem == 0 ? TRACE_INITIAL_EVENTS :
+                                                  t->eventMem * 2));
+        if(e == NULL) {
+            __atomic_add_fetch(&TraceDropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        t->event = e;
+        t->eventMem = t->eventMem == 0 ? TRACE_INITIAL_EVENTS : t->eventMem * 2;
+    }
+
+    e = &(t->event[t->events]);
+    e->start = start;
+    e->end = clock_ns();
+    e->name = name;
+    va_start(ap, format);
+    vsnprintf(e->arg, sizeof(e->arg), format, ap);
+    va_end(ap);
+    t->events++;
+}
+
+/* size bytes of s as a quoted JSON string, returns how long it is.  bytes
+   outside of ASCII are taken as latin-1, so the output is always valid JSON */
+unsigned int json_string(char *buf, const char *s, unsigned int size) {
+    unsigned char c;
+    unsigned int i;
+    unsigned int len = 0;
+
+    buf[len++] = '"';
+    for(i = 0; i < size; i++) {
+        c = s[i];
+        if(c == '"' || c == '\\') {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        } else if(c < 0x20 || c >= 0x7F) {
+            len += sprintf(&(buf[len]), "\\u%04x", c);
+        } else {
+            buf[len++] = c;
+        }
+    }
+    buf[len++] = '"';
+
+    return(len);
+}
+
+/* names are file names which may have backslashes in them */
+void trace_json_string(FILE *out, const char *s) {
+    char buf[JSON_STRING_MAX(TRACE_ARG_MAX)];
+
+    fwrite(buf, 1, json_string(buf, s, strnlen(s, TRACE_ARG_MAX)), out);
+}
+
+/* microseconds since the trace started */
+double trace_us(unsigned long long ns) {
+    return((double)(long long)(ns - TraceStart) / 1000.0);
+}
+
+/* spans are written as complete events, with a start and a duration, so they
+   always pair up */
+int trace_write(FILE *out) {
+    TraceThread *t;
+    TraceEvent *e;
+    unsigned int i;
+    int first = 1;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for(t = TraceThreads; t != NULL; t = t->next) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                     "\"tid\":%d,\"args\":{\"name\":",
+                     first ? "" : ",\n", t->tid);
+        trace_json_string(out, t->name);
+        fprintf(out, "}}");
+        first = 0;
+
+        for(i = 0; i < t->events; i++) {
+            e = &(t->event[i]);
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"detail\":",
+                         e->name, t->tid, trace_us(e->start),
+                         (e->end - e->start) / 1000.0);
+            trace_json_string(out, e->arg);
+            fprintf(out, "}}");
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    return(ferror(out) ? -1 : 0);
+}
+
+/* write out everything recorded, every other thread must be done by now */
+int trace_close() {
+    FILE *out;
+    TraceThread *t;
+    int ret = -1;
+
+    if(!Tracing) {
+        return(0);
+    }
+    Tracing = 0;
+
+    out = fopen(TraceFilename, "w");
+    if(out == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", TraceFilename, strerror(errno));
+        goto error0;
+    }
+    if(trace_write(out) < 0) {
+        fprintf(stderr, "Failed to write %s.\n", TraceFilename);
+        fclose(out);
+        goto error0;
+    }
+    if(fclose(out) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", TraceFilename, strerror(errno));
+        goto error0;
+    }
+    if(TraceDropped > 0) {
+        fprintf(stderr, "%u trace events were dropped.\n", TraceDropped);
+    }
+    ret = 0;
+
+error0:
+    while(TraceThreads != NULL) {
+        t = TraceThreads;
+        TraceThreads = t->next;
+        free(t->event);
+        free(t);
+    }
+    TraceCurrent = NULL;
+    free(TraceFilename);
+    TraceFilename = NULL;
+
+    return(ret);
+}
@@ -0,0 +1,39 @@
+#define TRACE_ARG_MAX (64)
+#define TRACE_INITIAL_EVENTS (1024)
+/* room json_string needs for a string of size bytes */
+#define JSON_STRING_MAX(size) ((size) * 6 + 2)
+
+/* a span which has ended, start and end are nanoseconds */
+typedef struct {
+    unsigned long long start;
+    unsigned long long end;
+    const char *name;
+    char arg[TRACE_ARG_MAX];
+} TraceEvent;
+
+/* events from one thread, only ever added to by that thread.  a row in the
+   trace is handed on to the next thread by the same name once released. */
+typedef struct TraceThread {
+    char name[TRACE_ARG_MAX];
+    int tid;
+    int inUse;
+
+    TraceEvent *event;
+    unsigned int events;
+    unsigned int eventMem;
+
+    struct TraceThread *next;
+} TraceThread;
+
+/* set while a trace is being recorded */
+extern int Tracing;
+
+int trace_open(const char *filename);
+unsigned long long trace_now();
+void trace_span(unsigned long long start, const char *name,
+                const char *format, ...)
+                __attribute__((format(printf, 3, 4)));
+void trace_thread(const char *name);
+void trace_thread_done();
+int trace_close();
+unsigned int json_string(char *buf, const char *s, unsigned int size);